@@ -0,0 +1,350 @@
+/******************************************************************************/
+/*                                                                            */
+/*  INFER.CU - Frozen-model batch inference on the device                     */
+/*                                                                            */
+/*  infer_cuda_init ( &im , max_cases , &dev , error_msg )                    */
+/*     Copy a frozen model to the current device as float, int8 weights       */
+/*     dequantized, and allocate work for max_cases cases per pass.           */
+/*  infer_cuda_batch ( &dev , nc , input , in_cols , output , error_msg )     */
+/*     Score nc cases in passes of max_cases.                                 */
+/*  infer_cuda_cleanup ( &dev )                                               */
+/*                                                                            */
+/*  Unlike MLFN.cu, nothing lives in constant memory: every pointer is a      */
+/*  launch parameter, so any number of INFER_DEVICEs may exist at once.       */
+/*  Each belongs to the host thread that created it, on the device that       */
+/*  was current then.                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#define STRICT
+#include <windows.h>
+#include <commctrl.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <ctype.h>
+#include <malloc.h>
+#include <new.h>
+#include <float.h>
+#include <process.h>
+
+#include <driver_types.h>
+#include <cuda_runtime_api.h>
+
+#include "deep.rh"
+#include "const.h"
+#include "classes.h"
+#include "extern.h"
+#include "funcdefs.h"
+#include "INFER.H"
+
+// Threads per block in the layer kernel, each computing one neuron of one
+// case.  The block shares each chunk of its case's inputs, this many long.
+
+#define INFER_CUDA_THREADS 128
+
+// The case is blockIdx.y, which is limited to this
+
+#define INFER_CUDA_MAX_CASES 65535
+
+
+/*
+--------------------------------------------------------------------------------
+
+   Kernels
+
+--------------------------------------------------------------------------------
+*/
+
+__global__ void infer_device_layer (
+   int nin ,                  // Inputs to this layer
+   int nout ,                 // Neurons in it
+   const float *prev ,        // Cases by ldp inputs
+   int ldp ,
+   const float *wt ,          // Nin rows of nout weights
+   const float *bias ,        // Nout biases
+   float *dest ,              // Cases by ldd activations
+   int ldd ,
+   int logistic               // Apply the logistic function?  Else linear.
+   )
+{
+   int j, k, k0, nk, icase ;
+   float sum ;
+   __shared__ float x[INFER_CUDA_THREADS] ;
+
+   j = blockIdx.x * blockDim.x + threadIdx.x ;
+   icase = blockIdx.y ;
+
+   sum = (j < nout)  ?  bias[j] : 0.0f ;
+
+   for (k0=0 ; k0<nin ; k0+=INFER_CUDA_THREADS) {
+      nk = (nin - k0 < INFER_CUDA_THREADS)  ?  nin - k0 : INFER_CUDA_THREADS ;
+      if (threadIdx.x < nk)
+         x[threadIdx.x] = prev[icase*ldp+k0+threadIdx.x] ;
+      __syncthreads () ;
+      if (j < nout) {
+         for (k=0 ; k<nk ; k++)     // Adjacent threads read adjacent weights
+            sum += x[k] * wt[(k0+k)*nout+j] ;
+         }
+      __syncthreads () ;
+      }
+
+   if (j < nout)
+      dest[icase*ldd+j] = logistic  ?  1.0f / (1.0f + __expf ( -sum )) : sum ;
+}
+
+
+__global__ void infer_device_softmax (
+   int nc ,                   // Cases in this pass
+   int ntarg ,                // Outputs
+   float *act ,               // Cases by ld outputs
+   int ld
+   )
+{
+   int icase, i ;
+   float *aptr, amax, sum ;
+
+   icase = blockIdx.x * blockDim.x + threadIdx.x ;
+   if (icase >= nc)
+      return ;
+
+   aptr = act + icase * ld ;
+   amax = aptr[0] ;
+   for (i=1 ; i<ntarg ; i++) {
+      if (aptr[i] > amax)
+         amax = aptr[i] ;
+      }
+   sum = 0.0f ;
+   for (i=0 ; i<ntarg ; i++) {
+      aptr[i] = __expf ( aptr[i] - amax ) ;
+      sum += aptr[i] ;
+      }
+   for (i=0 ; i<ntarg ; i++)
+      aptr[i] /= sum ;
+}
+
+
+/*
+--------------------------------------------------------------------------------
+
+   infer_cuda_init() and infer_cuda_cleanup()
+
+--------------------------------------------------------------------------------
+*/
+
+int infer_cuda_init (
+   INFER_MODEL *im ,          // Frozen model
+   int max_cases ,            // Most cases per device pass
+   INFER_DEVICE *dev ,        // Set up here
+   char *error_msg            // Returns text of error if problem
+   )
+{
+   int i, j, k, nin, nout ;
+   size_t memsize ;
+   float *fdata ;
+   cudaError_t error_id ;
+   cudaStream_t stream ;
+   INFER_LAYER *lay ;
+
+   memset ( dev , 0 , sizeof(INFER_DEVICE) ) ;
+
+   if (max_cases > INFER_CUDA_MAX_CASES)
+      max_cases = INFER_CUDA_MAX_CASES ;
+
+   dev->n_layers = im->header.n_layers ;
+   dev->n_inputs = im->header.n_inputs ;
+   dev->ntarg = im->header.n_units[im->header.n_layers-1] ;
+   dev->classifier = im->header.classifier ;
+   dev->max_units = im->header.max_units ;
+   dev->max_cases = max_cases ;
+   for (i=0 ; i<dev->n_layers ; i++)
+      dev->n_units[i] = im->header.n_units[i] ;
+
+   fdata = (float *) MALLOC ( (size_t) im->header.max_units * im->header.max_units * sizeof(float) ) ;
+   if (fdata == NULL) {
+      strcpy_s ( error_msg , 255 , "Insufficient memory for CUDA inference" ) ;
+      return INFER_ERROR_MEMORY ;
+      }
+
+/*
+   Weights and biases, as float whatever the host stores
+*/
+
+   for (i=0 ; i<dev->n_layers ; i++) {
+      lay = &im->layer[i] ;
+      nin = lay->nin ;
+      nout = lay->nout ;
+
+      for (k=0 ; k<nin ; k++) {
+         for (j=0 ; j<nout ; j++) {
+            if (im->header.precision == INFER_DOUBLE)
+               fdata[k*nout+j] = (float) ((double *) lay->wt)[k*nout+j] ;
+            else if (im->header.precision == INFER_FLOAT)
+               fdata[k*nout+j] = ((float *) lay->wt)[k*nout+j] ;
+            else
+               fdata[k*nout+j] = lay->scale[j] * ((signed char *) lay->wt)[k*nout+j] ;
+            }
+         }
+
+      memsize = (size_t) nin * nout * sizeof(float) ;
+      error_id = cudaMalloc ( (void **) &dev->d_wt[i] , memsize ) ;
+      if (error_id == cudaSuccess)
+         error_id = cudaMemcpy ( dev->d_wt[i] , fdata , memsize , cudaMemcpyHostToDevice ) ;
+
+      for (j=0 ; j<nout ; j++)
+         fdata[j] = (im->header.precision == INFER_DOUBLE)  ?
+                    (float) ((double *) lay->bias)[j] : ((float *) lay->bias)[j] ;
+
+      memsize = (size_t) nout * sizeof(float) ;
+      if (error_id == cudaSuccess)
+         error_id = cudaMalloc ( (void **) &dev->d_bias[i] , memsize ) ;
+      if (error_id == cudaSuccess)
+         error_id = cudaMemcpy ( dev->d_bias[i] , fdata , memsize , cudaMemcpyHostToDevice ) ;
+
+      if (error_id != cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA inference bad weights layer %d (%d): %s", i, error_id, cudaGetErrorString(error_id) ) ;
+         FREE ( fdata ) ;
+         infer_cuda_cleanup ( dev ) ;
+         return INFER_ERROR_CUDA ;
+         }
+      }
+
+   FREE ( fdata ) ;
+
+/*
+   Activations, the pinned transfer area, and the stream
+*/
+
+   memsize = (size_t) max_cases * dev->max_units * sizeof(float) ;
+   error_id = cudaMalloc ( (void **) &dev->d_act[0] , memsize ) ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMalloc ( (void **) &dev->d_act[1] , memsize ) ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMallocHost ( (void **) &dev->h_xfer , memsize ) ;
+   if (error_id == cudaSuccess) {
+      error_id = cudaStreamCreate ( &stream ) ;
+      if (error_id == cudaSuccess)
+         dev->stream = (void *) stream ;
+      }
+
+   if (error_id != cudaSuccess) {
+      sprintf_s ( error_msg , 255 , "CUDA inference bad work areas (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+      infer_cuda_cleanup ( dev ) ;
+      return INFER_ERROR_CUDA ;
+      }
+
+   return INFER_OK ;
+}
+
+
+void infer_cuda_cleanup ( INFER_DEVICE *dev )
+{
+   int i ;
+
+   for (i=0 ; i<INFER_MAX_LAYERS ; i++) {
+      if (dev->d_wt[i] != NULL)
+         cudaFree ( dev->d_wt[i] ) ;
+      if (dev->d_bias[i] != NULL)
+         cudaFree ( dev->d_bias[i] ) ;
+      dev->d_wt[i] = dev->d_bias[i] = NULL ;
+      }
+
+   for (i=0 ; i<2 ; i++) {
+      if (dev->d_act[i] != NULL)
+         cudaFree ( dev->d_act[i] ) ;
+      dev->d_act[i] = NULL ;
+      }
+
+   if (dev->h_xfer != NULL)
+      cudaFreeHost ( dev->h_xfer ) ;
+   dev->h_xfer = NULL ;
+
+   if (dev->stream != NULL)
+      cudaStreamDestroy ( (cudaStream_t) dev->stream ) ;
+   dev->stream = NULL ;
+}
+
+
+/*
+--------------------------------------------------------------------------------
+
+   infer_cuda_batch() - Score nc cases
+
+   Each pass sends up to max_cases rows of inputs in one copy, runs every
+   layer, and brings back just the ntarg output columns.
+
+--------------------------------------------------------------------------------
+*/
+
+int infer_cuda_batch (
+   INFER_DEVICE *dev ,        // From infer_cuda_init()
+   int nc ,                   // Number of cases
+   double *input ,            // Nc rows of in_cols; the first n_inputs are used
+   int in_cols ,              // Row length of input
+   double *output ,           // Nc rows of ntarg outputs returned here
+   char *error_msg            // Returns text of error if problem
+   )
+{
+   int i, icase, istart, nt, ilayer, ld, nin ;
+   float *prev, *dest ;
+   cudaError_t error_id ;
+   cudaStream_t stream ;
+   dim3 block_launch ;
+
+   stream = (cudaStream_t) dev->stream ;
+   ld = dev->max_units ;
+
+   for (istart=0 ; istart<nc ; istart+=dev->max_cases) {
+      nt = (nc - istart < dev->max_cases)  ?  nc - istart : dev->max_cases ;
+
+      for (icase=0 ; icase<nt ; icase++) {
+         for (i=0 ; i<dev->n_inputs ; i++)
+            dev->h_xfer[icase*dev->n_inputs+i] = (float) input[(size_t)(istart+icase)*in_cols+i] ;
+         }
+
+      // The first layer writes d_act[0], so the inputs go in d_act[1], packed
+      prev = dev->d_act[1] ;
+      error_id = cudaMemcpyAsync ( prev , dev->h_xfer , (size_t) nt * dev->n_inputs * sizeof(float) ,
+                                   cudaMemcpyHostToDevice , stream ) ;
+      nin = dev->n_inputs ;
+
+      for (ilayer=0 ; error_id == cudaSuccess  &&  ilayer<dev->n_layers ; ilayer++) {
+         dest = dev->d_act[ilayer % 2] ;
+         block_launch.x = (dev->n_units[ilayer] + INFER_CUDA_THREADS - 1) / INFER_CUDA_THREADS ;
+         block_launch.y = nt ;
+         block_launch.z = 1 ;
+         infer_device_layer <<< block_launch , INFER_CUDA_THREADS , 0 , stream >>>
+                ( nin , dev->n_units[ilayer] , prev , ilayer ? ld : dev->n_inputs ,
+                  dev->d_wt[ilayer] , dev->d_bias[ilayer] , dest , ld , ilayer < dev->n_layers-1 ) ;
+         error_id = cudaGetLastError () ;
+         prev = dest ;
+         nin = dev->n_units[ilayer] ;
+         }
+
+      if (error_id == cudaSuccess  &&  dev->classifier) {
+         infer_device_softmax <<< (nt + INFER_CUDA_THREADS - 1) / INFER_CUDA_THREADS , INFER_CUDA_THREADS , 0 , stream >>>
+                ( nt , dev->ntarg , prev , ld ) ;
+         error_id = cudaGetLastError () ;
+         }
+
+      if (error_id == cudaSuccess)
+         error_id = cudaMemcpy2DAsync ( dev->h_xfer , dev->ntarg * sizeof(float) , prev , ld * sizeof(float) ,
+                                        dev->ntarg * sizeof(float) , nt , cudaMemcpyDeviceToHost , stream ) ;
+      if (error_id == cudaSuccess)
+         error_id = cudaStreamSynchronize ( stream ) ;
+
+      if (error_id != cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA inference pass at case %d failed (%d): %s", istart, error_id, cudaGetErrorString(error_id) ) ;
+         return INFER_ERROR_CUDA ;
+         }
+
+      for (icase=0 ; icase<nt ; icase++) {
+         for (i=0 ; i<dev->ntarg ; i++)
+            output[(size_t)(istart+icase)*dev->ntarg+i] = dev->h_xfer[icase*dev->ntarg+i] ;
+         }
+      } // For each pass
+
+   return INFER_OK ;
+}
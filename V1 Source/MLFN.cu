@@ -26,8 +26,14 @@
 #include "classes.h"
 #include "extern.h"
 #include "funcdefs.h"
+#include "MLFN_CUDA.H"
+#include "PROFILE.H"
+
+#define DEBUG 0   // Nonzero to synchronize after every launch, so errors are reported where they happen
 
 // This is used as intermediary between device's float and hosts double
+// during init.  The weights and gradient, which cross on every call, use
+// each device's pinned xfer instead so the copies run at full bus speed.
 
 static float *fdata = NULL ;
 static int n_hid_weights ;  // Total number of hidden weights across all layers
@@ -46,8 +52,6 @@ static double total_memory = 0.0 ;
 #define REDUC_THREADS 256
 #define REDUC_BLOCKS 64
 
-static float *reduc_fdata = NULL ;
-
 
 // These are set in ?_cuda_init and used by the host routine that launches the kernel
 // They are basic app parameters, constant for all launches
@@ -63,52 +67,97 @@ static float *reduc_fdata = NULL ;
 __constant__ int d_ncases ;                // Number of cases in complete training set
 __constant__ int d_n_trn_inputs ;          // Number of first-layer inputs (training data)
 __constant__ int d_ntarg ;                 // Number of targets (output neurons)
+__constant__ int d_trn_first ;             // Case in the first row of d_trn_data; nonzero only if streaming
+__constant__ int d_trn_words ;             // Words per case in d_trn_bits if the data are packed, else 0
 
-static       int *h_nhid = NULL ;          // Number of neurons in each of the hidden layers
-__constant__ int *d_nhid ;
-
-static       float *h_trn_data = NULL ;    // Raw training data; ncases by n_trn_inputs
+__constant__ int *d_nhid ;                 // These pointers equal the MLFN_DEVICE members below
 __constant__ float *d_trn_data ;
-
-static       float *h_targets = NULL ;     // Target data; ncases by ntarg
+__constant__ unsigned int *d_trn_bits ;
 __constant__ float *d_targets ;
-
-static       int *h_class = NULL ;         // If classification (SoftMax), class id is here
 __constant__ int *d_class ;
-
-static       float *hidden_weights = NULL ;// Weight matricies for hidden layer
-static       float **h_whid = NULL ;
 __constant__ float **d_whid ;
-
-static       float *h_wout = NULL ;
 __constant__ float *d_wout ;
-
-static       double *activations = NULL ;  // Activations of this layer, which we compute
-static       double **h_act = NULL ;       // Array of pointers to each layer
 __constant__ double **d_act ;
-
-static       double *h_output = NULL ;     // Output activations
 __constant__ double *d_output ;
-
-static       float *h_mse_out = NULL ;
 __constant__ float *d_mse_out ;
-
-static       double *h_this_delta = NULL ; // Delta for current layer
 __constant__ double *d_this_delta ;
-
-static       double *h_prior_delta = NULL ;// Delta for next layer back
 __constant__ double *d_prior_delta ;
 
 // WARNING... If gradient is ever double instead of float, see MLFN_CUDA.CPP for integer overflow check!
 static       int h_gradlen ;               // Length of complete gradient for a case
 __constant__ int d_gradlen ;
-static       float *h_gradient = NULL ;    // Gradient for all layers, including output
 __constant__ float *d_gradient ;
-static       float **h_grad_ptr = NULL ;   // Pointers to locations in gradient for each layer
 __constant__ float **d_grad_ptr ;
 
 static cudaDeviceProp deviceProp ;
 
+
+/*
+   Everything on the host side that belongs to one device.  The h_ names are
+   as described above; each GPU has its own set, and because every device also
+   has its own copy of constant memory, the d_ symbols are simply set while
+   that device is current.
+
+   mlfn_cuda_select() makes a device current for the calling thread, both for
+   CUDA and for the dev pointer used by the routines below.  The host thread
+   that drives each device must call it first.
+*/
+
+#if defined ( _MSC_VER )
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+typedef struct {
+   int *h_nhid ;              // Number of neurons in each of the hidden layers
+   float *h_trn_data ;        // Raw training data; ncases by n_trn_inputs
+   unsigned int *h_trn_bits ; // Or if packed, bit j%32 of word j/32 of a case is input j; ncases by trn_words
+   int trn_words ;            // Words per case if packed, else 0
+   float *h_targets ;         // Target data; ncases by ntarg
+   int *h_class ;             // If classification (SoftMax), class id is here
+   float *hidden_weights ;    // Weight matricies for hidden layer
+   float **h_whid ;
+   float *h_wout ;
+   double *activations ;      // Activations of this layer, which we compute
+   double **h_act ;           // Array of pointers to each layer
+   double *h_output ;         // Output activations
+   float *h_mse_out ;
+   double *h_this_delta ;     // Delta for current layer
+   double *h_prior_delta ;    // Delta for next layer back
+   float *h_gradient ;        // Gradient for all layers, including output
+   float **h_grad_ptr ;       // Pointers to locations in gradient for each layer
+   float *xfer ;              // Pinned; h_gradlen long
+   float *reduc_fdata ;       // REDUC_BLOCKS long
+   int streaming ;            // Data stays on the host and comes down a batch at a time?
+   float *stage[2] ;          // If so, h_trn_data is one of these two max_batch by n_trn_inputs slots
+   int stage_start[2] ;       // First case in each slot, -1 if empty
+   int stage_stop[2] ;        // And one past its last
+   int stage_cur ;            // Slot the kernels are reading
+   cudaStream_t copy_stream ; // The next batch comes down on this while the current one runs
+   cudaEvent_t stage_copied[2] ;
+   cudaEvent_t stage_read[2] ;  // Recorded on the kernels' stream, after the last batch that read each slot
+} MLFN_DEVICE ;
+
+static int n_devices = 0 ;                     // Number initialized by mlfn_cuda_init
+static MLFN_DEVICE devices[MLFN_MAX_GPUS] ;
+static THREAD_LOCAL MLFN_DEVICE *dev = devices ;
+
+// If a device streams, this float copy of the inputs is the source of its
+// batches.  There is only one, shared by all devices, and it is pinned if
+// the system allows so that the copies can run asynchronously.
+
+static float *stream_host = NULL ;    // ncases by n_trn_inputs
+static int stream_host_pinned ;       // Was it allocated by cudaHostAlloc?
+static int stream_n_inputs ;
+
+// If every input is 0 or 1 (and MLFN_BINARY), a device that holds the data
+// keeps it as bits, a 32nd of the floats.  The first hidden layer then adds
+// the weights of the inputs that are on, and its gradient reads the bits.
+// A device that streams uses floats as usual.
+
+static int trn_binary ;               // Set by mlfn_cuda_init
+
 // Function declarations
 
 __global__ void device_hidden_activation ( int istart , int istop , int ilayer ) ;
@@ -121,8 +170,8 @@ __global__ void device_subsequent_hidden_gradient ( int nc , int ilayer , int la
 __global__ void device_move_delta ( int nhid ) ;
 __global__ void device_softmax ( int istart , int istop ) ;
 __global__ void device_fetch_gradient ( int nc ) ;
-__global__ void device_mse () ;
-__global__ void device_ll () ;
+__global__ void device_mse ( int istart , int istop ) ;
+__global__ void device_ll ( int istart , int istop ) ;
 
 
 /*
@@ -134,14 +183,100 @@ __global__ void device_ll () ;
    be called after training is complete.
 
    Fdata is used here to translate data from double (on the host) to float (on the device).
-   It is freed here, immediately after use, in most routines, but then
-   permanently allocated as a last step.
+   It is freed here, immediately after use.  The permanent xfer is pinned.
+
+   Each of the n_gpus devices gets a complete copy of the data and its own
+   work areas.  The caller decides which cases each device processes;
+   max_batch is the largest batch on any of them.
+
+   If the data will not fit beside the work areas (or MLFN_STREAM is set),
+   the device instead gets two max_batch slots and mlfn_cuda_stage() must
+   be called before each batch.  The gradient work area is max_batch times
+   the number of weights, so the slots are small next to it and whatever
+   batch size lets that fit will do for them too.
 
 --------------------------------------------------------------------------------
 */
 
+static int mlfn_cuda_init_device ( int idev , int classifier , int *class_ids , int ncases ,
+                                   int n_inputs , int ncols , double *data , int ntarg ,
+                                   double *targets , int max_batch , int n_layers , int *nhid ,
+                                   char *error_msg ) ;
+
+int mlfn_cuda_max_devices ()
+{
+   int n ;
+
+   if (cudaGetDeviceCount ( &n ) != cudaSuccess  ||  n < 1)
+      n = 1 ;                 // Let mlfn_cuda_init report the failure
+   if (n > MLFN_MAX_GPUS)
+      n = MLFN_MAX_GPUS ;
+   return n ;
+}
+
+int mlfn_cuda_n_devices ()
+{
+   return n_devices ;
+}
+
+int mlfn_cuda_select ( int idev )
+{
+   dev = &devices[idev] ;
+   return cudaSetDevice ( idev ) != cudaSuccess ;
+}
 
 int mlfn_cuda_init (
+   int classifier ,       // Is this for classification? (SoftMax outputs)
+   int *class_ids ,       // Class ids if classifier
+   int ncases ,           // Number of training cases
+   int n_inputs ,         // Number of inputs
+   int ncols ,            // Number of columns in data (may exceed n_inputs)
+   double *data ,         // Input data, ncases rows by ncols columns, of which first n_inputs are used
+   int ntarg ,            // Number of targets (outputs; classes in classification)
+   double *targets ,      // Targets, ncases by ntarg
+   int max_batch ,        // Max size of any batch
+   int n_layers ,         // Number of layers of neurons, including output
+   int *nhid ,            // Number of neurons in each hidden layer
+   int n_gpus ,           // Number of devices to use, at most mlfn_cuda_max_devices()
+   char *error_msg        // Returns text of error if problem
+   )
+{
+   int i, j, idev, ret_val ;
+
+   MEMTEXT ( "MLFN.cu: mlfn_cuda_init starting" ) ;
+   cudalog ( "" ) ;
+
+   trn_binary = MLFN_BINARY ;
+   for (i=0 ; i<ncases  &&  trn_binary ; i++) {
+      for (j=0 ; j<n_inputs ; j++) {
+         if (data[i*ncols+j] != 0.0  &&  data[i*ncols+j] != 1.0) {
+            trn_binary = 0 ;
+            break ;
+            }
+         }
+      }
+
+   n_devices = 0 ;
+   ret_val = 0 ;
+   for (idev=0 ; idev<n_gpus ; idev++) {
+      n_devices = idev + 1 ;  // So that cleanup frees a partly initialized device
+      ret_val = mlfn_cuda_init_device ( idev , classifier , class_ids , ncases , n_inputs , ncols ,
+                                        data , ntarg , targets , max_batch , n_layers , nhid , error_msg ) ;
+      if (ret_val)
+         break ;
+      }
+
+   mlfn_cuda_select ( 0 ) ;
+
+   if (ret_val == 0) {
+      MEMTEXT ( "MLFN.cu: mlfn_cuda_init finished" ) ;
+      }
+   return ret_val ;
+}
+
+
+static int mlfn_cuda_init_device (
+   int idev ,             // Which device
    int classifier ,       // Is this for classification? (SoftMax outputs)
    int *class_ids ,       // Class ids if classifier
    int ncases ,           // Number of training cases
@@ -157,54 +292,29 @@ int mlfn_cuda_init (
    )
 {
    int i, j, n, n_total, n_max, n_prior, memsize ;
+   size_t free_mem, total_mem, work, data_size ;
+   unsigned int *bits ;
    float *gptr, *fptr[MAX_LAYERS] ;
    double *dptr[MAX_LAYERS] ;
    char msg[256] ;
    cudaError_t error_id ;
 
-   MEMTEXT ( "MLFN.cu: mlfn_cuda_init starting" ) ;
-   cudalog ( "" ) ;
+   dev = &devices[idev] ;
+   memset ( dev , 0 , sizeof(MLFN_DEVICE) ) ;
 
-   CudaTimers.mlfn_ncalls_weights = 0 ;
-   CudaTimers.mlfn_weights = 0 ;
-   for (i=0 ; i<MAX_LAYERS ; i++) {
-      CudaTimers.mlfn_ncalls_hidden[i] = 0 ;
-      CudaTimers.mlfn_hidden[i] = 0 ;
-      }
-   CudaTimers.mlfn_ncalls_outact = 0 ;
-   CudaTimers.mlfn_outact = 0 ;
-   CudaTimers.mlfn_ncalls_softmax = 0 ;
-   CudaTimers.mlfn_softmax = 0 ;
-   CudaTimers.mlfn_ncalls_ll = 0 ;
-   CudaTimers.mlfn_ll = 0 ;
-   CudaTimers.mlfn_ncalls_mse = 0 ;
-   CudaTimers.mlfn_mse = 0 ;
-   CudaTimers.mlfn_ncalls_wpen = 0 ;
-   CudaTimers.mlfn_wpen = 0 ;
-   CudaTimers.mlfn_ncalls_outdelta = 0 ;
-   CudaTimers.mlfn_outdelta = 0 ;
-   CudaTimers.mlfn_ncalls_outgrad = 0 ;
-   CudaTimers.mlfn_outgrad = 0 ;
-   for (i=0 ; i<MAX_LAYERS ; i++) {
-      CudaTimers.mlfn_ncalls_subgrad[i] = 0 ;
-      CudaTimers.mlfn_subgrad[i] = 0 ;
-      }
-   CudaTimers.mlfn_ncalls_firstgrad = 0 ;
-   CudaTimers.mlfn_firstgrad = 0 ;
-   CudaTimers.mlfn_ncalls_fetchgrad = 0 ;
-   CudaTimers.mlfn_fetchgrad = 0 ;
-
-
-   error_id = cudaSetDevice ( 0 ) ;
+   error_id = cudaSetDevice ( idev ) ;
    if (error_id  !=  cudaSuccess) {
-      sprintf_s ( error_msg , 255 , "CUDA init SetDevice failed %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      sprintf_s ( error_msg , 255 , "CUDA init SetDevice %d failed %d: %s", idev, error_id, cudaGetErrorString(error_id) ) ;
       MEMTEXT ( error_msg ) ;
       audit ( error_msg ) ;
       cuda_enable = 0 ;
       return ERROR_CUDA_ERROR ;
       }
 
-   cudaGetDeviceProperties ( &deviceProp , 0 ) ;
+   cudaGetDeviceProperties ( &deviceProp , idev ) ;  // Every device is assumed to have the same warp size
+
+   sprintf_s ( msg, 255 , "CUDA device %d: %s", idev, deviceProp.name ) ;
+   cudalog ( msg ) ;
 
 
 /*
@@ -214,6 +324,9 @@ int mlfn_cuda_init (
    cudaMemcpyToSymbol ( d_ncases , &ncases , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
    cudaMemcpyToSymbol ( d_n_trn_inputs , &n_inputs , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
    cudaMemcpyToSymbol ( d_ntarg , &ntarg , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
+   n = 0 ;
+   cudaMemcpyToSymbol ( d_trn_first , &n , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_trn_words , &n , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;  // Set below if packed
 
 
 /*
@@ -222,17 +335,17 @@ int mlfn_cuda_init (
 
    memsize = (n_layers-1) * sizeof(int) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_nhid , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_nhid , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC nhid = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_nhid, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_nhid, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc nhid (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   error_id = cudaMemcpy ( h_nhid , nhid , (n_layers-1) * sizeof(int) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_nhid , nhid , (n_layers-1) * sizeof(int) , cudaMemcpyHostToDevice ) ;
    if (error_id  ==  cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_nhid , &h_nhid , sizeof(int *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_nhid , &dev->h_nhid , sizeof(int *) , 0 , cudaMemcpyHostToDevice ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMemcpy nhid (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_ERROR ;
@@ -243,36 +356,154 @@ int mlfn_cuda_init (
    Data - We must extract only the first n_inputs columns from the ncols columns in data
 */
 
-   fdata = (float *) MALLOC ( ncases * n_inputs * sizeof(float) ) ;
-   if (fdata == NULL)
-      return ERROR_INSUFFICIENT_MEMORY ;
+   n = 0 ;                    // Weights in the model; the gradient work area is this times max_batch
+   n_prior = n_inputs ;
+   n_total = 0 ;
+   n_max = ntarg ;
+   for (i=0 ; i<n_layers-1 ; i++) {
+      n += nhid[i] * (n_prior + 1) ;
+      n_prior = nhid[i] ;
+      n_total += nhid[i] ;
+      if (nhid[i] > n_max)
+         n_max = nhid[i] ;
+      }
+   n += ntarg * (n_prior + 1) ;
 
-   memsize = ncases * n_inputs * sizeof(float) ;
-   total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_trn_data , (size_t) memsize ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC data = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_trn_data, memsize, total_memory / (1024 * 1024) ) ;
-   cudalog ( msg ) ;
-   if (error_id  !=  cudaSuccess) {
-      sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc data (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
-      return ERROR_CUDA_MEMORY ;
+   work = (size_t) max_batch * n * sizeof(float)
+        + (size_t) max_batch * (n_total + ntarg + 2 * n_max) * sizeof(double)
+        + (size_t) ncases * (ntarg * sizeof(float) + sizeof(int))
+        + (size_t) 64 * 1024 * 1024 ;   // Weights, reductions and the runtime's own needs
+
+   dev->trn_words = trn_binary  ?  (n_inputs + 31) / 32 : 0 ;
+   if (dev->trn_words)
+      data_size = (size_t) ncases * dev->trn_words * sizeof(unsigned int) ;
+   else
+      data_size = (size_t) ncases * n_inputs * sizeof(float) ;
+
+   dev->streaming = MLFN_STREAM ;
+   if (! dev->streaming  &&  cudaMemGetInfo ( &free_mem , &total_mem ) == cudaSuccess)
+      dev->streaming = data_size + work > free_mem ;
+   if (dev->streaming)
+      dev->trn_words = 0 ;
+
+   if (dev->streaming) {
+      sprintf_s ( msg, 255 , "CUDA device %d streams the data in batches of %d cases", idev, max_batch ) ;
+      cudalog ( msg ) ;
+
+      if (stream_host == NULL) {
+         if (cudaHostAlloc ( (void **) &stream_host , (size_t) ncases * n_inputs * sizeof(float) ,
+                             cudaHostAllocPortable ) == cudaSuccess)
+            stream_host_pinned = 1 ;
+         else {
+            stream_host = (float *) MALLOC ( (size_t) ncases * n_inputs * sizeof(float) ) ;
+            stream_host_pinned = 0 ;
+            if (stream_host == NULL)
+               return ERROR_INSUFFICIENT_MEMORY ;
+            }
+         for (i=0 ; i<ncases ; i++) {
+            for (j=0 ; j<n_inputs ; j++)
+               stream_host[i*n_inputs+j] = (float) data[i*ncols+j] ;
+            }
+         stream_n_inputs = n_inputs ;
+         }
+
+      error_id = cudaStreamCreateWithFlags ( &dev->copy_stream , cudaStreamNonBlocking ) ;
+      for (i=0 ; i<2 ; i++) {
+         memsize = max_batch * n_inputs * sizeof(float) ;
+         total_memory += memsize ;
+         if (error_id == cudaSuccess)
+            error_id = cudaMalloc ( (void **) &dev->stage[i] , (size_t) memsize ) ;
+         if (error_id == cudaSuccess)
+            error_id = cudaEventCreateWithFlags ( &dev->stage_copied[i] , cudaEventDisableTiming ) ;
+         if (error_id == cudaSuccess)
+            error_id = cudaEventCreateWithFlags ( &dev->stage_read[i] , cudaEventDisableTiming ) ;
+         dev->stage_start[i] = -1 ;
+         }
+      sprintf_s ( msg, 255 , "CUDA MALLOC data slots = %llx %llx  (%d bytes each, total=%.2lf MB)",
+                  (unsigned long long) dev->stage[0], (unsigned long long) dev->stage[1],
+                  memsize, total_memory / (1024 * 1024) ) ;
+      cudalog ( msg ) ;
+      if (error_id  !=  cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA init bad data slots (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_MEMORY ;
+         }
+      dev->stage_cur = 1 ;    // So that the first batch goes into slot 0
       }
 
-   for (i=0 ; i<ncases ; i++) {
-      for (j=0 ; j<n_inputs ; j++)
-         fdata[i*n_inputs+j] = (float) data[i*ncols+j] ;
+   else if (dev->trn_words) {
+      sprintf_s ( msg, 255 , "CUDA device %d holds the binary data as bits", idev ) ;
+      cudalog ( msg ) ;
+
+      bits = (unsigned int *) MALLOC ( data_size ) ;
+      if (bits == NULL)
+         return ERROR_INSUFFICIENT_MEMORY ;
+
+      memsize = (int) data_size ;
+      total_memory += memsize ;
+      error_id = cudaMalloc ( (void **) &dev->h_trn_bits , data_size ) ;
+      sprintf_s ( msg, 255 , "CUDA MALLOC data bits = %llx  (%d bytes, total=%.2lf MB)",
+                  (unsigned long long) dev->h_trn_bits, memsize, total_memory / (1024 * 1024) ) ;
+      cudalog ( msg ) ;
+      if (error_id  !=  cudaSuccess) {
+         FREE ( bits ) ;
+         sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc data bits (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_MEMORY ;
+         }
+
+      memset ( bits , 0 , data_size ) ;
+      for (i=0 ; i<ncases ; i++) {
+         for (j=0 ; j<n_inputs ; j++) {
+            if (data[i*ncols+j] != 0.0)
+               bits[i*dev->trn_words+j/32] |= 1u << (j % 32) ;
+            }
+         }
+
+      error_id = cudaMemcpy ( dev->h_trn_bits , bits , data_size , cudaMemcpyHostToDevice ) ;
+      FREE ( bits ) ;
+
+      if (error_id == cudaSuccess)
+         error_id = cudaMemcpyToSymbol ( d_trn_bits , &dev->h_trn_bits , sizeof(unsigned int *) , 0 , cudaMemcpyHostToDevice ) ;
+      if (error_id == cudaSuccess)
+         error_id = cudaMemcpyToSymbol ( d_trn_words , &dev->trn_words , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
+
+      if (error_id  !=  cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA init bad data bits copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_ERROR ;
+         }
       }
 
-   error_id = cudaMemcpy ( h_trn_data , fdata , ncases * n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
-   FREE ( fdata ) ;
-   fdata = NULL ;
+   else {
+      fdata = (float *) MALLOC ( ncases * n_inputs * sizeof(float) ) ;
+      if (fdata == NULL)
+         return ERROR_INSUFFICIENT_MEMORY ;
 
-   if (error_id == cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_trn_data , &h_trn_data , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
+      memsize = ncases * n_inputs * sizeof(float) ;
+      total_memory += memsize ;
+      error_id = cudaMalloc ( (void **) &dev->h_trn_data , (size_t) memsize ) ;
+      sprintf_s ( msg, 255 , "CUDA MALLOC data = %llx  (%d bytes, total=%.2lf MB)",
+                  (unsigned long long) dev->h_trn_data, memsize, total_memory / (1024 * 1024) ) ;
+      cudalog ( msg ) ;
+      if (error_id  !=  cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc data (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_MEMORY ;
+         }
 
-   if (error_id  !=  cudaSuccess) {
-      sprintf_s ( error_msg , 255 , "CUDA init bad data copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
-      return ERROR_CUDA_ERROR ;
+      for (i=0 ; i<ncases ; i++) {
+         for (j=0 ; j<n_inputs ; j++)
+            fdata[i*n_inputs+j] = (float) data[i*ncols+j] ;
+         }
+
+      error_id = cudaMemcpy ( dev->h_trn_data , fdata , ncases * n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      FREE ( fdata ) ;
+      fdata = NULL ;
+
+      if (error_id == cudaSuccess)
+         error_id = cudaMemcpyToSymbol ( d_trn_data , &dev->h_trn_data , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
+
+      if (error_id  !=  cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA init bad data copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_ERROR ;
+         }
       }
 
 
@@ -286,9 +517,9 @@ int mlfn_cuda_init (
 
    memsize = ncases * ntarg * sizeof(float) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_targets , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_targets , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC targets = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_targets, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_targets, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc targets (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -300,12 +531,12 @@ int mlfn_cuda_init (
          fdata[i*ntarg+j] = (float) targets[i*ntarg+j] ;
       }
 
-   error_id = cudaMemcpy ( h_targets , fdata , ncases * ntarg * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_targets , fdata , ncases * ntarg * sizeof(float) , cudaMemcpyHostToDevice ) ;
    FREE ( fdata ) ;
    fdata = NULL ;
 
    if (error_id == cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_targets , &h_targets , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_targets , &dev->h_targets , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
 
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad targets copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -320,19 +551,19 @@ int mlfn_cuda_init (
    if (classifier) {
       memsize = ncases * sizeof(int) ;
       total_memory += memsize ;
-      error_id = cudaMalloc ( (void **) &h_class , (size_t) memsize ) ;
+      error_id = cudaMalloc ( (void **) &dev->h_class , (size_t) memsize ) ;
       sprintf_s ( msg, 255 , "CUDA MALLOC class = %llx  (%d bytes, total=%.2lf MB)",
-                  (unsigned long long) h_class, memsize, total_memory / (1024 * 1024) ) ;
+                  (unsigned long long) dev->h_class, memsize, total_memory / (1024 * 1024) ) ;
       cudalog ( msg ) ;
       if (error_id  !=  cudaSuccess) {
          sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc class (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
          return ERROR_CUDA_MEMORY ;
          }
 
-      error_id = cudaMemcpy ( h_class , class_ids , ncases * sizeof(int) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_class , class_ids , ncases * sizeof(int) , cudaMemcpyHostToDevice ) ;
 
       if (error_id == cudaSuccess)
-         error_id = cudaMemcpyToSymbol ( d_class , &h_class , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+         error_id = cudaMemcpyToSymbol ( d_class , &dev->h_class , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
       if (error_id  !=  cudaSuccess) {
          sprintf_s ( error_msg , 255 , "CUDA init bad class copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -350,9 +581,9 @@ int mlfn_cuda_init (
 
    memsize = n_total * max_batch * sizeof(double) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &activations , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->activations , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC activations = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) activations, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->activations, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc activations (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -361,24 +592,24 @@ int mlfn_cuda_init (
 
    memsize = (n_layers-1) * sizeof(void *) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_act , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_act , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC act = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_act, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_act, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc act (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
 
-   cudaMemcpyToSymbol ( d_act , &h_act , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_act , &dev->h_act , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
    n_total = 0 ;
    for (i=0 ; i<n_layers-1 ; i++) {
-      dptr[i] = activations + n_total * max_batch ;
+      dptr[i] = dev->activations + n_total * max_batch ;
       n_total += nhid[i] ;
       }
 
-   error_id = cudaMemcpy ( h_act , &dptr[0] , (n_layers-1) * sizeof(void *) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_act , &dptr[0] , (n_layers-1) * sizeof(void *) , cudaMemcpyHostToDevice ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad act ptr copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_ERROR ;
@@ -391,12 +622,12 @@ int mlfn_cuda_init (
 
    memsize = ncases * ntarg * sizeof(double) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_output , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_output , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC output = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_output, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_output, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  ==  cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_output , &h_output , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_output , &dev->h_output , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc output (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
@@ -417,9 +648,9 @@ int mlfn_cuda_init (
 
    memsize = n_total * sizeof(float) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &hidden_weights , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->hidden_weights , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC hidden_weights = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) hidden_weights, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->hidden_weights, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc hidden_weights (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -428,26 +659,26 @@ int mlfn_cuda_init (
 
    memsize = (n_layers-1) * sizeof(float *) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_whid , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_whid , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC whid = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_whid, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_whid, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc whid (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
 
-   cudaMemcpyToSymbol ( d_whid , &h_whid , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_whid , &dev->h_whid , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
    n_total = 0 ;
    n_prior = n_inputs ;
    for (i=0 ; i<n_layers-1 ; i++) {
-      fptr[i] = hidden_weights + n_total ;
+      fptr[i] = dev->hidden_weights + n_total ;
       n_total += nhid[i] * (n_prior + 1) ;
       n_prior = nhid[i] ;
       }
 
-   error_id = cudaMemcpy ( h_whid , &fptr[0] , (n_layers-1) * sizeof(float *) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_whid , &fptr[0] , (n_layers-1) * sizeof(float *) , cudaMemcpyHostToDevice ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad whid ptr copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_ERROR ;
@@ -461,12 +692,12 @@ int mlfn_cuda_init (
    n_out_weights = ntarg * (nhid[n_layers-2]+1) ;
    memsize = n_out_weights * sizeof(float) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_wout , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_wout , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC wout = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_wout, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_wout, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  ==  cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_wout , &h_wout , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_wout , &dev->h_wout , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc wout (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
@@ -484,12 +715,12 @@ int mlfn_cuda_init (
 
    memsize = n_max * max_batch * sizeof(double) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_this_delta , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_this_delta , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC this_delta = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_this_delta, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_this_delta, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  ==  cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_this_delta , &h_this_delta , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_this_delta , &dev->h_this_delta , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc this_delta (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
@@ -497,12 +728,12 @@ int mlfn_cuda_init (
 
    memsize = n_max * max_batch * sizeof(double) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_prior_delta , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_prior_delta , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC prior_delta = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_prior_delta, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_prior_delta, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  ==  cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_prior_delta , &h_prior_delta , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_prior_delta , &dev->h_prior_delta , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc prior_delta (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
@@ -523,31 +754,31 @@ int mlfn_cuda_init (
 
    memsize = h_gradlen * max_batch * sizeof(float) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_gradient , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_gradient , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC h_gradient = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_gradient, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_gradient, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc h_gradient (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
 
-   cudaMemcpyToSymbol ( d_gradient , &h_gradient , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_gradient , &dev->h_gradient , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
    memsize = n_layers * sizeof(float *) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_grad_ptr , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_grad_ptr , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC grad_ptr = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_whid, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_whid, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc grad_ptr (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
 
-   cudaMemcpyToSymbol ( d_grad_ptr , &h_grad_ptr , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_grad_ptr , &dev->h_grad_ptr , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   gptr = h_gradient ;
+   gptr = dev->h_gradient ;
    for (i=0 ; i<n_layers ; i++) {
       fptr[i] = gptr ;
 
@@ -562,7 +793,7 @@ int mlfn_cuda_init (
          }
       }
 
-   error_id = cudaMemcpy ( h_grad_ptr , &fptr[0] , n_layers * sizeof(void *) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_grad_ptr , &fptr[0] , n_layers * sizeof(void *) , cudaMemcpyHostToDevice ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad grad_ptr copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_ERROR ;
@@ -575,31 +806,33 @@ int mlfn_cuda_init (
 
    memsize = REDUC_BLOCKS * sizeof(float) ;
    total_memory += memsize ;
-   error_id = cudaMalloc ( (void **) &h_mse_out , (size_t) memsize ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_mse_out , (size_t) memsize ) ;
    sprintf_s ( msg, 255 , "CUDA MALLOC mse_out = %llx  (%d bytes, total=%.2lf MB)",
-               (unsigned long long) h_mse_out, memsize, total_memory / (1024 * 1024) ) ;
+               (unsigned long long) dev->h_mse_out, memsize, total_memory / (1024 * 1024) ) ;
    cudalog ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc mse_out (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_mse_out , &h_mse_out , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_mse_out , &dev->h_mse_out , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
    MEMTEXT ( "CUDA init reduc_fdata" ) ;
-   reduc_fdata = (float *) MALLOC ( REDUC_BLOCKS * sizeof(float) ) ;
-   if (reduc_fdata == NULL) {
+   dev->reduc_fdata = (float *) MALLOC ( REDUC_BLOCKS * sizeof(float) ) ;
+   if (dev->reduc_fdata == NULL) {
       sprintf_s ( error_msg , 255 , "CUDA init bad MALLOC reduc_fdata" ) ;
       return ERROR_INSUFFICIENT_MEMORY ;  // New error return
       }
 
 
 /*
-   Allocate fdata large enough to handle all subsequent double <-> float transactions
+   Allocate xfer large enough to handle all subsequent double <-> float transactions
 */
 
-   fdata = (float *) MALLOC ( h_gradlen * sizeof(float) ) ;
-   if (fdata == NULL)
+   error_id = cudaMallocHost ( (void **) &dev->xfer , h_gradlen * sizeof(float) ) ;
+   if (error_id  !=  cudaSuccess) {
+      sprintf_s ( error_msg , 255 , "CUDA init bad cudaMallocHost xfer (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_INSUFFICIENT_MEMORY ;
+      }
 
 
 /*
@@ -634,7 +867,6 @@ int mlfn_cuda_init (
       return ERROR_CUDA_ERROR ;
       }
 
-   MEMTEXT ( "MLFN.cu: mlfn_cuda_init finished" ) ;
    return 0 ;
 }
 
@@ -661,7 +893,7 @@ int cuda_weights_to_device (
    char msg[256] ;
    cudaError_t error_id ;
    
-   fptr = fdata ;
+   fptr = dev->xfer ;
    n_prior = n_inputs ;
 
    for (ilayer=0 ; ilayer<n_layers-1 ; ilayer++) {
@@ -673,7 +905,10 @@ int cuda_weights_to_device (
       n_prior = nhid[ilayer] ;
       }
 
-   error_id = cudaMemcpy ( hidden_weights , fdata , n_hid_weights * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   PROF_CUDA_BEGIN ( "hidden weights" , PROF_CAT_COPY , 0 ) ;
+   error_id = cudaMemcpy ( dev->hidden_weights , dev->xfer , n_hid_weights * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   PROF_CUDA_END ( 0 ) ;
+   PROF_COUNT ( PROF_BYTES_H2D , n_hid_weights * sizeof(float) ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( msg , 255 , "CUDA ERROR: bad weights_to_device hid %d: %s", error_id, cudaGetErrorString(error_id) ) ;
       audit ( "" ) ;
@@ -682,7 +917,7 @@ int cuda_weights_to_device (
       return ERROR_CUDA_ERROR ;
       }
 
-   fptr = fdata ;
+   fptr = dev->xfer ;
    wptr = final_layer_weights ;
 
    for (ivar=0 ; ivar<=n_prior ; ivar++) {
@@ -690,7 +925,10 @@ int cuda_weights_to_device (
          *fptr++ = (float) wptr[ineuron*(n_prior+1)+ivar] ;
       }
 
-   error_id = cudaMemcpy ( h_wout , fdata , n_out_weights * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   PROF_CUDA_BEGIN ( "output weights" , PROF_CAT_COPY , 0 ) ;
+   error_id = cudaMemcpy ( dev->h_wout , dev->xfer , n_out_weights * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   PROF_CUDA_END ( 0 ) ;
+   PROF_COUNT ( PROF_BYTES_H2D , n_out_weights * sizeof(float) ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( msg , 255 , "CUDA ERROR: bad weights_to_device out %d: %s", error_id, cudaGetErrorString(error_id) ) ;
       audit ( "" ) ;
@@ -703,6 +941,100 @@ int cuda_weights_to_device (
 }
 
 
+/*
+--------------------------------------------------------------------------------
+
+   mlfn_cuda_stage - Called from MLFN_CUDA.CPP before each batch
+
+   If this device streams its data, make cases istart through istop-1 the
+   ones the kernels read, and start the copy of next_start through
+   next_stop-1 into the other slot so that it overlaps this batch.
+   Next_start is -1 if there is nothing to fetch ahead.
+   Launches are not followed by a synchronize, so the kernels of the
+   previous batch may still be reading their slot.  Each slot's
+   stage_read event marks the end of those kernels on the default stream,
+   and a copy into the slot waits for it on the device; the kernels wait
+   for a slot's copy through its stage_copied event.
+   If the device holds all of the data this does nothing.
+
+--------------------------------------------------------------------------------
+*/
+
+static int stage_copy ( int islot , int istart , int istop )
+{
+   cudaError_t error_id ;
+
+   error_id = cudaStreamWaitEvent ( dev->copy_stream , dev->stage_read[islot] , 0 ) ;
+   if (error_id != cudaSuccess)
+      return 1 ;
+
+   PROF_CUDA_BEGIN ( "stage batch" , PROF_CAT_COPY , dev->copy_stream ) ;
+   error_id = cudaMemcpyAsync ( dev->stage[islot] , stream_host + (size_t) istart * stream_n_inputs ,
+                                (size_t) (istop - istart) * stream_n_inputs * sizeof(float) ,
+                                cudaMemcpyHostToDevice , dev->copy_stream ) ;
+   PROF_CUDA_END ( dev->copy_stream ) ;
+   PROF_COUNT ( PROF_BYTES_H2D , (size_t) (istop - istart) * stream_n_inputs * sizeof(float) ) ;
+   if (error_id == cudaSuccess)
+      error_id = cudaEventRecord ( dev->stage_copied[islot] , dev->copy_stream ) ;
+   dev->stage_start[islot] = istart ;
+   dev->stage_stop[islot] = istop ;
+   return error_id != cudaSuccess ;
+}
+
+int mlfn_cuda_stage ( int istart , int istop , int next_start , int next_stop )
+{
+   int islot ;
+   char msg[256] ;
+   cudaError_t error_id ;
+
+   if (! dev->streaming)
+      return 0 ;
+
+   // Everything the previous batch launched is queued by now
+   error_id = cudaEventRecord ( dev->stage_read[dev->stage_cur] , 0 ) ;
+   if (error_id != cudaSuccess)
+      goto FAILED ;
+
+   for (islot=0 ; islot<2 ; islot++) {
+      if (dev->stage_start[islot] == istart  &&  dev->stage_stop[islot] == istop)
+         break ;
+      }
+
+   if (islot == 2) {          // Not fetched ahead, so fetch it now
+      islot = 1 - dev->stage_cur ;
+      if (stage_copy ( islot , istart , istop ))
+         goto FAILED ;
+      }
+
+   dev->stage_cur = islot ;
+   dev->h_trn_data = dev->stage[islot] ;
+
+   error_id = cudaEventSynchronize ( dev->stage_copied[islot] ) ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyToSymbol ( d_trn_data , &dev->h_trn_data , sizeof(float *) , 0 , cudaMemcpyHostToDevice ) ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyToSymbol ( d_trn_first , &istart , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
+   if (error_id != cudaSuccess)
+      goto FAILED ;
+
+   if (next_start >= 0  &&  (next_start != istart  ||  next_stop != istop)
+                        &&  (next_start != dev->stage_start[1-islot]  ||  next_stop != dev->stage_stop[1-islot])) {
+      if (stage_copy ( 1 - islot , next_start , next_stop ))
+         goto FAILED ;
+      }
+
+   return 0 ;
+
+FAILED:
+   error_id = cudaGetLastError () ;
+   sprintf_s ( msg , 255 , "CUDA ERROR: bad mlfn_cuda_stage %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+   audit ( "" ) ;
+   audit ( msg ) ;
+   MEMTEXT ( msg ) ;
+   return ERROR_CUDA_ERROR ;
+}
+
+
 /*
 --------------------------------------------------------------------------------
 
@@ -717,7 +1049,8 @@ __global__ void device_hidden_activation (
    int ilayer         // Layer to process
    )
 {
-   int icase, ihid, i_input, n_inputs, nhid ;
+   int icase, ihid, i_input, n_inputs, nhid, iword ;
+   unsigned int word, *bits ;
    float *f_inptr, *wptr ;
    double sum, *actptr, *d_inptr ;
 
@@ -733,9 +1066,22 @@ __global__ void device_hidden_activation (
    actptr = d_act[ilayer] ;
    sum = 0.0 ;
 
-   if (ilayer == 0) {
+   if (ilayer == 0  &&  d_trn_words) {  // Packed; every thread of the block walks the same bits
+      n_inputs = d_n_trn_inputs ;
+      bits = d_trn_bits + (icase+istart)*d_trn_words ;
+      for (iword=0 ; iword<d_trn_words ; iword++) {
+         word = bits[iword] ;
+         while (word) {
+            i_input = iword * 32 + __ffs ( word ) - 1 ;
+            sum += wptr[i_input*nhid+ihid] ;
+            word &= word - 1 ;
+            }
+         }
+      sum += wptr[n_inputs*nhid+ihid] ;  // Bias
+      }
+   else if (ilayer == 0) {
       n_inputs = d_n_trn_inputs ;
-      f_inptr = d_trn_data + (icase+istart)*n_inputs ;
+      f_inptr = d_trn_data + (icase+istart-d_trn_first)*n_inputs ;
       for (i_input=0 ; i_input<n_inputs ; i_input++)
          sum += wptr[i_input*nhid+ihid] * f_inptr[i_input] ;
       sum += wptr[n_inputs*nhid+ihid] ;  // Bias
@@ -773,8 +1119,12 @@ int cuda_hidden_activation (
    block_launch.y = istop - istart ;
    block_launch.z = 1 ;
 
+   PROF_CUDA_BEGIN ( "hidden_activation" , PROF_CAT_KERNEL , 0 ) ;
    device_hidden_activation <<< block_launch , threads_per_block >>> ( istart , istop , ilayer ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_hidden_activation launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -844,8 +1194,12 @@ int cuda_output_activation (
    block_launch.y = istop - istart ;
    block_launch.z = 1 ;
 
+   PROF_CUDA_BEGIN ( "output_activation" , PROF_CAT_KERNEL , 0 ) ;
    device_output_activation <<< block_launch , threads_per_block >>> ( istart , n_inputs , ilayer ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_output_activation launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -924,12 +1278,16 @@ int cuda_output_delta (
    block_launch.y = istop - istart ;
    block_launch.z = 1 ;
 
+   PROF_CUDA_BEGIN ( "output_delta" , PROF_CAT_KERNEL , 0 ) ;
    if (classifier)
       device_softmax_delta <<< block_launch , threads_per_block >>> ( istart , istop , ntarg ) ;   
    else
       device_output_delta <<< block_launch , threads_per_block >>> ( istart , istop , ntarg ) ;   
+   PROF_CUDA_END ( 0 ) ;
 
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_output_delta launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -999,8 +1357,12 @@ int cuda_output_gradient (
    block_launch.y = nc ;
    block_launch.z = ntarg ;
 
+   PROF_CUDA_BEGIN ( "output_gradient" , PROF_CAT_KERNEL , 0 ) ;
    device_output_gradient <<< block_launch , threads_per_block >>> ( nc , ilayer ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_output_gradient launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1036,8 +1398,10 @@ __global__ void device_first_hidden_gradient (
 
    if (iin > d_n_trn_inputs)
       return ;
+   else if (iin < d_n_trn_inputs  &&  d_trn_words)
+      input = ((d_trn_bits[(icase+istart)*d_trn_words+iin/32] >> (iin % 32)) & 1)  ?  1.0f : 0.0f ;
    else if (iin < d_n_trn_inputs)
-      input = d_trn_data[(icase+istart)*d_n_trn_inputs+iin] ;  // Feed coming into this layer
+      input = d_trn_data[(icase+istart-d_trn_first)*d_n_trn_inputs+iin] ;  // Feed coming into this layer
    else
       input = 1.0f ;             // Bias
 
@@ -1089,8 +1453,12 @@ int cuda_first_hidden_gradient (
    block_launch.y = istop - istart ;
    block_launch.z = nhid ;
 
+   PROF_CUDA_BEGIN ( "first_hidden_gradient" , PROF_CAT_KERNEL , 0 ) ;
    device_first_hidden_gradient <<< block_launch , threads_per_block >>> ( istart , istop , only_hidden ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_first_hidden_gradient launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1199,8 +1567,12 @@ int cuda_subsequent_hidden_gradient (
    block_launch.y = nc ;
    block_launch.z = nhid_this ;
 
+   PROF_CUDA_BEGIN ( "subsequent_hidden_gradient" , PROF_CAT_KERNEL , 0 ) ;
    device_subsequent_hidden_gradient <<< block_launch , threads_per_block >>> ( nc , ilayer , last_hidden ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_subsequent_hidden_gradient launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1223,8 +1595,12 @@ int cuda_subsequent_hidden_gradient (
    block_launch.y = nc ;
    block_launch.z = 1 ;
 
+   PROF_CUDA_BEGIN ( "move_delta" , PROF_CAT_KERNEL , 0 ) ;
    device_move_delta <<< block_launch , threads_per_block >>> ( nhid_this ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_move_delta launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1292,8 +1668,12 @@ int cuda_softmax (
 
    blocks_per_grid = (n + threads_per_block - 1) / threads_per_block ;
 
+   PROF_CUDA_BEGIN ( "softmax" , PROF_CAT_KERNEL , 0 ) ;
    device_softmax <<< blocks_per_grid , threads_per_block >>> ( istart , istop ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_softmax launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1351,8 +1731,12 @@ int cuda_fetch_gradient (
 
    blocks_per_grid = (h_gradlen + threads_per_block - 1) / threads_per_block ;
 
+   PROF_CUDA_BEGIN ( "fetch_gradient" , PROF_CAT_KERNEL , 0 ) ;
    device_fetch_gradient <<< blocks_per_grid , threads_per_block >>> ( nc ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_fetch_gradient launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1361,9 +1745,12 @@ int cuda_fetch_gradient (
       return 1 ;
       }
 
-   error_id = cudaMemcpy ( fdata , h_gradient , h_gradlen * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+   PROF_CUDA_BEGIN ( "gradient to host" , PROF_CAT_COPY , 0 ) ;
+   error_id = cudaMemcpy ( dev->xfer , dev->h_gradient , h_gradlen * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+   PROF_CUDA_END ( 0 ) ;
+   PROF_COUNT ( PROF_BYTES_D2H , h_gradlen * sizeof(float) ) ;
    for (i=0 ; i<h_gradlen ; i++)
-      grad[i] += fdata[i] ;
+      grad[i] += dev->xfer[i] ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_fetch_gradient copy error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
       audit ( msg ) ;
@@ -1385,7 +1772,10 @@ int cuda_fetch_gradient (
 ------------------------------------------------------------------------------------------------
 */
 
-__global__ void device_mse ()
+__global__ void device_mse (
+   int istart ,         // First case for this device
+   int istop            // And one past its last
+   )
 {
    __shared__ double partial_mse[REDUC_THREADS] ;
    int i, index ;
@@ -1393,10 +1783,10 @@ __global__ void device_mse ()
    double diff, sum_mse ;
 
    index = threadIdx.x ;
-   n = d_ncases * d_ntarg ;
+   n = istop * d_ntarg ;
 
    sum_mse = 0.0 ;   
-   for (i=blockIdx.x*blockDim.x+index ; i<n ; i+=blockDim.x*gridDim.x) {
+   for (i=istart*d_ntarg+blockIdx.x*blockDim.x+index ; i<n ; i+=blockDim.x*gridDim.x) {
       diff = d_output[i] - d_targets[i] ;
       sum_mse += diff * diff ;
       }
@@ -1416,8 +1806,10 @@ __global__ void device_mse ()
 
 
 int cuda_mse (
-   int n ,           // Number of values; ncases * ntarg
-   double *mse       // Computed mse criterion
+   int istart ,      // First case on the current device
+   int istop ,       // And one past its last
+   int n ,           // Number of values; ncases * ntarg over all devices
+   double *mse       // Computed mse criterion; this device's share if several
    )
 {
    int i, blocks_per_grid ;
@@ -1425,12 +1817,16 @@ int cuda_mse (
    char msg[256] ;
    cudaError_t error_id ;
 
-   blocks_per_grid = (n + REDUC_THREADS - 1) / REDUC_THREADS ;
+   blocks_per_grid = (n + REDUC_THREADS - 1) / REDUC_THREADS ;   // Grid-stride; an upper bound is fine
    if (blocks_per_grid > REDUC_BLOCKS)
       blocks_per_grid = REDUC_BLOCKS ;
 
-   device_mse <<< blocks_per_grid , REDUC_THREADS >>> () ;   
+   PROF_CUDA_BEGIN ( "mse" , PROF_CAT_KERNEL , 0 ) ;
+   device_mse <<< blocks_per_grid , REDUC_THREADS >>> ( istart , istop ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
 
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
@@ -1440,10 +1836,10 @@ int cuda_mse (
       return 1 ;
       }
 
-   error_id = cudaMemcpy ( reduc_fdata , h_mse_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+   error_id = cudaMemcpy ( dev->reduc_fdata , dev->h_mse_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
    sum = 0.0 ;
    for (i=0 ; i<blocks_per_grid ; i++)
-      sum += reduc_fdata[i] ;
+      sum += dev->reduc_fdata[i] ;
    *mse = sum / n ;
 
    if (error_id != cudaSuccess) {
@@ -1467,18 +1863,20 @@ int cuda_mse (
 ------------------------------------------------------------------------------------------------
 */
 
-__global__ void device_ll ()
+__global__ void device_ll (
+   int istart ,         // First case for this device
+   int istop            // And one past its last
+   )
 {
    __shared__ double partial_ll[REDUC_THREADS] ;
-   int i, n, ntarg, index ;
+   int i, ntarg, index ;
    double sum_ll ;
 
    index = threadIdx.x ;
-   n = d_ncases ;
    ntarg = d_ntarg ;
 
    sum_ll = 0.0 ;   
-   for (i=blockIdx.x*blockDim.x+index ; i<n ; i+=blockDim.x*gridDim.x)
+   for (i=istart+blockIdx.x*blockDim.x+index ; i<istop ; i+=blockDim.x*gridDim.x)
       sum_ll -= log ( d_output[i*ntarg+d_class[i]] + 1.e-30 ) ;
 
    partial_ll[index] = sum_ll ;
@@ -1496,8 +1894,10 @@ __global__ void device_ll ()
 
 
 int cuda_ll (
-   int n ,          // Number of values; ncases
-   double *ll       // Computed dot product
+   int istart ,     // First case on the current device
+   int istop ,      // And one past its last
+   int n ,          // Number of values; ncases over all devices
+   double *ll       // Computed log likelihood; this device's share if several
    )
 {
    int i, blocks_per_grid ;
@@ -1509,8 +1909,12 @@ int cuda_ll (
    if (blocks_per_grid > REDUC_BLOCKS)
       blocks_per_grid = REDUC_BLOCKS ;
 
-   device_ll <<< blocks_per_grid , REDUC_THREADS >>> () ;   
+   PROF_CUDA_BEGIN ( "ll" , PROF_CAT_KERNEL , 0 ) ;
+   device_ll <<< blocks_per_grid , REDUC_THREADS >>> ( istart , istop ) ;   
+   PROF_CUDA_END ( 0 ) ;
+#if DEBUG
    cudaDeviceSynchronize() ;
+#endif
 
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
@@ -1520,10 +1924,10 @@ int cuda_ll (
       return 1 ;
       }
 
-   error_id = cudaMemcpy ( reduc_fdata , h_mse_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+   error_id = cudaMemcpy ( dev->reduc_fdata , dev->h_mse_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
    sum = 0.0 ;
    for (i=0 ; i<blocks_per_grid ; i++)
-      sum += reduc_fdata[i] ;
+      sum += dev->reduc_fdata[i] ;
    *ll = sum / n ;
 
    if (error_id != cudaSuccess) {
@@ -1545,212 +1949,139 @@ int cuda_ll (
 --------------------------------------------------------------------------------
 */
 
-void mlfn_cuda_cleanup ( int classifier , int n_layers )
+void mlfn_cuda_cleanup ( int classifier , int n_layers )  // Neither is needed here now
 {
-   int ilayer ;
-   double sum ;
-   char msg[256] ;
+   int i, idev ;
 
    MEMTEXT ( "CUDA mlfn_cuda_cleanup starting" ) ;
 
-   if (h_trn_data != NULL) {
-      cudaFree ( h_trn_data ) ;
-      h_trn_data = NULL ;
-      }
-
-   if (h_targets != NULL) {
-      cudaFree ( h_targets ) ;
-      h_targets = NULL ;
-      }
-
-   if (h_class != NULL) {
-      cudaFree ( h_class ) ;
-      h_class = NULL ;
-      }
-
-   if (h_nhid != NULL) {
-      cudaFree ( h_nhid ) ;
-      h_nhid = NULL ;
-      }
-
-   if (hidden_weights != NULL) {
-      cudaFree ( hidden_weights ) ;
-      hidden_weights = NULL ;
-      }
-
-   if (h_whid != NULL) {
-      cudaFree ( h_whid ) ;
-      h_whid = NULL ;
-      }
-
-   if (h_wout != NULL) {
-      cudaFree ( h_wout ) ;
-      h_wout = NULL ;
-      }
-
-   if (activations != NULL) {
-      cudaFree ( activations ) ;
-      activations = NULL ;
-      }
-
-   if (h_act != NULL) {
-      cudaFree ( h_act ) ;
-      h_act = NULL ;
-      }
-
-   if (h_output != NULL) {
-      cudaFree ( h_output ) ;
-      h_output = NULL ;
-      }
-
-   if (h_this_delta != NULL) {
-      cudaFree ( h_this_delta ) ;
-      h_this_delta = NULL ;
-      }
-
-   if (h_prior_delta != NULL) {
-      cudaFree ( h_prior_delta ) ;
-      h_prior_delta = NULL ;
-      }
-
-   if (h_gradient != NULL) {
-      cudaFree ( h_gradient ) ;
-      h_gradient = NULL ;
-      }
+   for (idev=0 ; idev<n_devices ; idev++) {
+      mlfn_cuda_select ( idev ) ;
+
+      if (dev->streaming) {   // Then h_trn_data is one of the slots
+         for (i=0 ; i<2 ; i++) {
+            if (dev->stage[i] != NULL)
+               cudaFree ( dev->stage[i] ) ;
+            if (dev->stage_copied[i] != NULL)
+               cudaEventDestroy ( dev->stage_copied[i] ) ;
+            if (dev->stage_read[i] != NULL)
+               cudaEventDestroy ( dev->stage_read[i] ) ;
+            }
+         if (dev->copy_stream != NULL)
+            cudaStreamDestroy ( dev->copy_stream ) ;
+         dev->h_trn_data = NULL ;
+         }
 
-   if (h_grad_ptr != NULL) {
-      cudaFree ( h_grad_ptr ) ;
-      h_grad_ptr = NULL ;
-      }
+      if (dev->h_trn_data != NULL) {
+         cudaFree ( dev->h_trn_data ) ;
+         dev->h_trn_data = NULL ;
+         }
 
-   if (h_mse_out != NULL) {
-      cudaFree ( h_mse_out ) ;
-      h_mse_out = NULL ;
-      }
+      if (dev->h_trn_bits != NULL) {
+         cudaFree ( dev->h_trn_bits ) ;
+         dev->h_trn_bits = NULL ;
+         }
 
-   if (fdata != NULL) {
-      FREE ( fdata ) ;
-      fdata = NULL ;
-      }
+      if (dev->h_targets != NULL) {
+         cudaFree ( dev->h_targets ) ;
+         dev->h_targets = NULL ;
+         }
 
-   if (reduc_fdata != NULL) {
-      FREE ( reduc_fdata ) ;
-      reduc_fdata = NULL ;
-      }
+      if (dev->h_class != NULL) {
+         cudaFree ( dev->h_class ) ;
+         dev->h_class = NULL ;
+         }
 
-   total_memory = 0.0 ;
+      if (dev->h_nhid != NULL) {
+         cudaFree ( dev->h_nhid ) ;
+         dev->h_nhid = NULL ;
+         }
 
-   cudaDeviceReset () ;
+      if (dev->hidden_weights != NULL) {
+         cudaFree ( dev->hidden_weights ) ;
+         dev->hidden_weights = NULL ;
+         }
 
+      if (dev->h_whid != NULL) {
+         cudaFree ( dev->h_whid ) ;
+         dev->h_whid = NULL ;
+         }
 
-/*
-   Print CUDA timers
-*/
+      if (dev->h_wout != NULL) {
+         cudaFree ( dev->h_wout ) ;
+         dev->h_wout = NULL ;
+         }
 
-   sum = 0.0 ;
-   for (ilayer=0 ; ilayer<MAX_LAYERS ; ilayer++) {
-      sum += CudaTimers.mlfn_hidden[ilayer] ;
-      sum += CudaTimers.mlfn_subgrad[ilayer] ;
-      }
+      if (dev->activations != NULL) {
+         cudaFree ( dev->activations ) ;
+         dev->activations = NULL ;
+         }
 
-   sum += CudaTimers.mlfn_weights + CudaTimers.mlfn_outact + CudaTimers.mlfn_softmax +
-          CudaTimers.mlfn_ll + CudaTimers.mlfn_mse + CudaTimers.mlfn_wpen + CudaTimers.mlfn_outdelta +
-          CudaTimers.mlfn_outgrad + CudaTimers.mlfn_firstgrad + CudaTimers.mlfn_fetchgrad ;
+      if (dev->h_act != NULL) {
+         cudaFree ( dev->h_act ) ;
+         dev->h_act = NULL ;
+         }
 
-   cudalog ( "" ) ;
-   cudalog ( "" ) ;
-   cudalog ( "MLFN CUDA times in seconds: total, (percent), per launch" ) ;
+      if (dev->h_output != NULL) {
+         cudaFree ( dev->h_output ) ;
+         dev->h_output = NULL ;
+         }
 
-   sprintf ( msg, "  Send weights =   %8.3lf   (%5.1lf percent) %10.6lf per launch",
-             0.001 * CudaTimers.mlfn_weights,
-             100.0 * CudaTimers.mlfn_weights / sum,
-             0.001 * CudaTimers.mlfn_weights / CudaTimers.mlfn_ncalls_weights ) ;
-   cudalog ( msg ) ;
+      if (dev->h_this_delta != NULL) {
+         cudaFree ( dev->h_this_delta ) ;
+         dev->h_this_delta = NULL ;
+         }
 
-   for (ilayer=0 ; ilayer<n_layers-1 ; ilayer++) {
-      sprintf ( msg, "  Hid %2d act =     %8.3lf   (%5.1lf percent) %10.6lf per launch", ilayer+1,
-                0.001 * CudaTimers.mlfn_hidden[ilayer],
-                100.0 * CudaTimers.mlfn_hidden[ilayer] / sum,
-                0.001 * CudaTimers.mlfn_hidden[ilayer] / CudaTimers.mlfn_ncalls_hidden[ilayer] ) ;
-      cudalog ( msg ) ;
-      }
+      if (dev->h_prior_delta != NULL) {
+         cudaFree ( dev->h_prior_delta ) ;
+         dev->h_prior_delta = NULL ;
+         }
 
-   sprintf ( msg, "  Output act =     %8.3lf   (%5.1lf percent) %10.6lf per launch",
-             0.001 * CudaTimers.mlfn_outact,
-             100.0 * CudaTimers.mlfn_outact / sum,
-             0.001 * CudaTimers.mlfn_outact / CudaTimers.mlfn_ncalls_outact ) ;
-   cudalog ( msg ) ;
+      if (dev->h_gradient != NULL) {
+         cudaFree ( dev->h_gradient ) ;
+         dev->h_gradient = NULL ;
+         }
 
-   if (classifier) {
-      sprintf ( msg, "  SoftMax =        %8.3lf   (%5.1lf percent) %10.6lf per launch",
-                0.001 * CudaTimers.mlfn_softmax,
-                100.0 * CudaTimers.mlfn_softmax / sum,
-                0.001 * CudaTimers.mlfn_softmax / CudaTimers.mlfn_ncalls_softmax ) ;
-      cudalog ( msg ) ;
-      }
+      if (dev->h_grad_ptr != NULL) {
+         cudaFree ( dev->h_grad_ptr ) ;
+         dev->h_grad_ptr = NULL ;
+         }
 
-   if (CudaTimers.mlfn_ncalls_outdelta) {
-      sprintf ( msg, "  Output delta =   %8.3lf   (%5.1lf percent) %10.6lf per launch",
-                0.001 * CudaTimers.mlfn_outdelta,
-                100.0 * CudaTimers.mlfn_outdelta / sum,
-                0.001 * CudaTimers.mlfn_outdelta / CudaTimers.mlfn_ncalls_outdelta ) ;
-      cudalog ( msg ) ;
-      }
+      if (dev->h_mse_out != NULL) {
+         cudaFree ( dev->h_mse_out ) ;
+         dev->h_mse_out = NULL ;
+         }
 
-   if (CudaTimers.mlfn_ncalls_outgrad) {
-      sprintf ( msg, "  Output grad =    %8.3lf   (%5.1lf percent) %10.6lf per launch",
-                0.001 * CudaTimers.mlfn_outgrad,
-                100.0 * CudaTimers.mlfn_outgrad / sum,
-                0.001 * CudaTimers.mlfn_outgrad / CudaTimers.mlfn_ncalls_outgrad ) ;
-      cudalog ( msg ) ;
-      }
+      if (dev->xfer != NULL) {
+         cudaFreeHost ( dev->xfer ) ;
+         dev->xfer = NULL ;
+         }
 
-   for (ilayer=n_layers-2 ; ilayer>0 ; ilayer--) {
-      if (CudaTimers.mlfn_ncalls_subgrad[ilayer-1]) {
-         sprintf ( msg, "  Hid %2d grad =    %8.3lf   (%5.1lf percent) %10.6lf per launch", ilayer+1,
-                   0.001 * CudaTimers.mlfn_subgrad[ilayer-1],
-                   100.0 * CudaTimers.mlfn_subgrad[ilayer-1] / sum,
-                   0.001 * CudaTimers.mlfn_subgrad[ilayer-1] / CudaTimers.mlfn_ncalls_subgrad[ilayer-1] ) ;
-         cudalog ( msg ) ;
+      if (dev->reduc_fdata != NULL) {
+         FREE ( dev->reduc_fdata ) ;
+         dev->reduc_fdata = NULL ;
          }
-      }
 
-   if (CudaTimers.mlfn_ncalls_firstgrad) {
-      sprintf ( msg, "  First grad =     %8.3lf   (%5.1lf percent) %10.6lf per launch",
-                0.001 * CudaTimers.mlfn_firstgrad,
-                100.0 * CudaTimers.mlfn_firstgrad / sum,
-                0.001 * CudaTimers.mlfn_firstgrad / CudaTimers.mlfn_ncalls_firstgrad ) ;
-      cudalog ( msg ) ;
+      cudaDeviceReset () ;
       }
 
-   if (CudaTimers.mlfn_ncalls_fetchgrad) {
-      sprintf ( msg, "  Fetch grad =     %8.3lf   (%5.1lf percent) %10.6lf per launch",
-                0.001 * CudaTimers.mlfn_fetchgrad,
-                100.0 * CudaTimers.mlfn_fetchgrad / sum,
-                0.001 * CudaTimers.mlfn_fetchgrad / CudaTimers.mlfn_ncalls_fetchgrad ) ;
-      cudalog ( msg ) ;
+   if (stream_host != NULL) {
+      if (stream_host_pinned)
+         cudaFreeHost ( stream_host ) ;
+      else
+         FREE ( stream_host ) ;
+      stream_host = NULL ;
       }
 
-   if (classifier) {
-      sprintf ( msg, "  Log likelihood = %8.3lf   (%5.1lf percent) %10.6lf per launch",
-                0.001 * CudaTimers.mlfn_ll,
-                100.0 * CudaTimers.mlfn_ll / sum,
-                0.001 * CudaTimers.mlfn_ll / CudaTimers.mlfn_ncalls_ll ) ;
-      cudalog ( msg ) ;
-      }
-   else {
-      sprintf ( msg, "  MSE =            %8.3lf   (%5.1lf percent) %10.6lf per launch",
-                0.001 * CudaTimers.mlfn_mse,
-                100.0 * CudaTimers.mlfn_mse / sum,
-                0.001 * CudaTimers.mlfn_mse / CudaTimers.mlfn_ncalls_mse ) ;
-      cudalog ( msg ) ;
+   n_devices = 0 ;
+   dev = devices ;
+
+   if (fdata != NULL) {
+      FREE ( fdata ) ;
+      fdata = NULL ;
       }
 
-   sprintf ( msg, "  Weight penalty = %8.3lf   (%5.1lf percent) %10.6lf per launch",
-             0.001 * CudaTimers.mlfn_wpen,
-             100.0 * CudaTimers.mlfn_wpen / sum,
-             0.001 * CudaTimers.mlfn_wpen / CudaTimers.mlfn_ncalls_wpen ) ;
-   cudalog ( msg ) ;
+   total_memory = 0.0 ;
 
    MEMTEXT ( "CUDA mlfn_cuda_cleanup ending" ) ;
 }
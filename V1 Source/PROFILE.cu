@@ -0,0 +1,191 @@
+/******************************************************************************/
+/*                                                                            */
+/*  PROFILE.CU - Device scopes for PROFILE.CPP, timed by cudaEvents           */
+/*                                                                            */
+/*  prof_cuda_begin ( name , cat , stream ) - Record a start event on stream  */
+/*  prof_cuda_end ( stream ) - Record the matching stop event                 */
+/*  prof_cuda_flush () - Wait for the recorded events and turn each pair      */
+/*                       into a trace event.  prof_epoch() and                */
+/*                       prof_write_trace() call it through prof_flush_hook.  */
+/*                                                                            */
+/*  The host never waits for the device while scopes are recorded, so the     */
+/*  kernels overlap exactly as they would unprofiled.  Each device gets its   */
+/*  own event pool, since an event can only be recorded on a stream of the    */
+/*  device it was made on, and a base event whose host time is taken after    */
+/*  synchronizing on it; event times are placed on the host clock as offsets  */
+/*  from that.  Scopes beyond PROF_CUDA_PAIRS per device between flushes are  */
+/*  dropped.                                                                  */
+/*                                                                            */
+/******************************************************************************/
+
+#define STRICT
+#include <windows.h>
+#include <commctrl.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <ctype.h>
+#include <malloc.h>
+#include <new.h>
+#include <float.h>
+#include <process.h>
+
+#include <driver_types.h>
+#include <cuda_runtime_api.h>
+
+#include "deep.rh"
+#include "const.h"
+#include "classes.h"
+#include "extern.h"
+#include "funcdefs.h"
+#include "PROFILE.H"
+
+#if defined ( _MSC_VER )
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Everything below is per device, made on that device
+
+static int pairs_made[PROF_MAX_DEVICES] ;                // Events exist for this many pairs
+static cudaEvent_t ev_start[PROF_MAX_DEVICES][PROF_CUDA_PAIRS] ;
+static cudaEvent_t ev_stop[PROF_MAX_DEVICES][PROF_CUDA_PAIRS] ;
+static const char *ev_name[PROF_MAX_DEVICES][PROF_CUDA_PAIRS] ;
+static int ev_cat[PROF_MAX_DEVICES][PROF_CUDA_PAIRS] ;
+static volatile LONG n_pairs[PROF_MAX_DEVICES] ;         // Claimed since the last flush
+
+static int have_base[PROF_MAX_DEVICES] ;
+static cudaEvent_t base_event[PROF_MAX_DEVICES] ;
+static long long base_time[PROF_MAX_DEVICES] ;           // Host clock when base_event completed
+
+static THREAD_LOCAL int open_pair = -1 ;                 // This thread's scope awaiting its stop
+static THREAD_LOCAL int open_dev = -1 ;                  // And the device whose pool it is in
+
+static CRITICAL_SECTION setup_lock ;
+static int setup_done = 0 ;
+
+
+/*
+   Make this device's event pool and base, once, with it current.  Threads
+   that drive different devices may arrive together, so this is locked.
+   It is only reached on the first scope on a device.
+*/
+
+static int prof_cuda_setup ( int idev )
+{
+   int i, ret_val ;
+
+   if (! setup_done) {        // The first scope comes from the single training thread
+      InitializeCriticalSection ( &setup_lock ) ;
+      setup_done = 1 ;
+      }
+
+   EnterCriticalSection ( &setup_lock ) ;
+   ret_val = 0 ;
+
+   while (pairs_made[idev] < PROF_CUDA_PAIRS) {
+      if (cudaEventCreate ( &ev_start[idev][pairs_made[idev]] ) != cudaSuccess)
+         break ;
+      if (cudaEventCreate ( &ev_stop[idev][pairs_made[idev]] ) != cudaSuccess) {
+         cudaEventDestroy ( ev_start[idev][pairs_made[idev]] ) ;
+         break ;
+         }
+      ++pairs_made[idev] ;
+      }
+
+   if (! have_base[idev]) {
+      if (cudaEventCreate ( &base_event[idev] ) == cudaSuccess  &&
+          cudaEventRecord ( base_event[idev] , 0 ) == cudaSuccess  &&
+          cudaEventSynchronize ( base_event[idev] ) == cudaSuccess) {
+         base_time[idev] = prof_now () ;
+         have_base[idev] = 1 ;
+         }
+      else
+         ret_val = 1 ;
+      }
+
+   for (i=0 ; i<PROF_MAX_DEVICES ; i++) // Nothing to flush until some device has a base
+      if (have_base[i])
+         prof_flush_hook = prof_cuda_flush ;
+
+   LeaveCriticalSection ( &setup_lock ) ;
+   return ret_val ;
+}
+
+
+void prof_cuda_begin ( const char *name , int cat , void *stream )
+{
+   int i, idev ;
+
+   open_pair = open_dev = -1 ;
+
+   if (cudaGetDevice ( &idev ) != cudaSuccess  ||  idev < 0  ||  idev >= PROF_MAX_DEVICES)
+      return ;
+   if (! have_base[idev]  &&  prof_cuda_setup ( idev ))
+      return ;
+
+   i = (int) InterlockedIncrement ( &n_pairs[idev] ) - 1 ;
+   if (i >= pairs_made[idev])
+      return ;                // Full until the next flush
+
+   ev_name[idev][i] = name ;
+   ev_cat[idev][i] = cat ;
+   if (cudaEventRecord ( ev_start[idev][i] , (cudaStream_t) stream ) == cudaSuccess) {
+      open_pair = i ;
+      open_dev = idev ;
+      }
+}
+
+void prof_cuda_end ( void *stream )
+{
+   if (open_pair < 0)
+      return ;
+   if (cudaEventRecord ( ev_stop[open_dev][open_pair] , (cudaStream_t) stream ) != cudaSuccess)
+      ev_name[open_dev][open_pair] = NULL ;   // Flush skips it
+   open_pair = open_dev = -1 ;
+}
+
+
+/*
+   Called with no scopes being recorded.  Waits for the last stop events,
+   so it also waits for the device work they follow.
+*/
+
+void prof_cuda_flush ()
+{
+   int i, n, idev, save_dev ;
+   float ms0, ms1 ;
+   double ticks_per_ms ;
+
+   ticks_per_ms = 0.001 / prof_seconds ( 0 , 1 ) ;
+
+   if (cudaGetDevice ( &save_dev ) != cudaSuccess)
+      save_dev = 0 ;
+
+   for (idev=0 ; idev<PROF_MAX_DEVICES ; idev++) {
+      if (! have_base[idev])
+         continue ;
+      cudaSetDevice ( idev ) ;
+      n = (n_pairs[idev] < pairs_made[idev])  ?  n_pairs[idev] : pairs_made[idev] ;
+      for (i=0 ; i<n ; i++) {
+         if (ev_name[idev][i] == NULL)
+            continue ;
+         if (cudaEventSynchronize ( ev_stop[idev][i] ) != cudaSuccess  ||
+             cudaEventElapsedTime ( &ms0 , base_event[idev] , ev_start[idev][i] ) != cudaSuccess  ||
+             cudaEventElapsedTime ( &ms1 , base_event[idev] , ev_stop[idev][i] ) != cudaSuccess) {
+            cudaGetLastError () ;   // A scope that never got its stop; not worth reporting
+            continue ;
+            }
+         prof_event_tid ( ev_name[idev][i] , ev_cat[idev][i] , -1 - idev ,
+                          base_time[idev] + (long long) (ms0 * ticks_per_ms) ,
+                          base_time[idev] + (long long) (ms1 * ticks_per_ms) , 0.0 ) ;
+         ev_name[idev][i] = NULL ;
+         }
+      n_pairs[idev] = 0 ;
+      }
+
+   cudaSetDevice ( save_dev ) ;
+}
@@ -26,6 +26,13 @@
 #include "classes.h"
 #include "extern.h"
 #include "funcdefs.h"
+#include "RNG.H"
+#include "RBM_CUDA.H"
+#include "PROFILE.H"
+
+#if RBM_CUBLAS
+#include <cublas_v2.h>
+#endif
 
 // These are for the reductions used in device_len_dot and in device_max_inc/w.
 // The number of threads MUST be a power of two!
@@ -34,6 +41,14 @@
 #define REDUC_THREADS 256
 #define REDUC_BLOCKS 64
 
+// Device_batch_sums finishes these in h_batch_sums, so a batch returns only them
+
+#define RBM_SUM_ERR 0      // Reconstruction error summed over inputs
+#define RBM_SUM_MAX 1      // Max absolute weight increment
+#define RBM_SUM_LEN 2      // Squared length of the weight gradient
+#define RBM_SUM_DOT 3      // Its dot product with the previous one
+#define RBM_N_BATCH_SUMS 4
+
 static float *reduc_fdata = NULL ;
 
 
@@ -42,6 +57,16 @@ static float *reduc_fdata = NULL ;
 static float *fdata = NULL ;
 
 
+#if RBM_CUBLAS
+static int mm_n_inputs, mm_nhid, mm_mean_field ;  // Host copies for the cuBLAS calls
+
+// cuBLAS must not allocate its own workspace while the batch is being
+// captured into a graph, so each handle gets this much of ours at init.
+
+#define RBM_CUBLAS_WORKSPACE (4 * 1024 * 1024)
+#endif
+
+
 // These are set in ?_cuda_init and used by the host routine that launches the kernel
 // They are basic app parameters, constant for all launches
 // Names that begin with d_ are in the device namespace.
@@ -53,80 +78,317 @@ static float *fdata = NULL ;
 // already set on the device rather than having to use passed parameters.
 // The savings is probably small, but worthwhile.
 
-__constant__ int d_ncases ;        // Number of cases (needed for using shuffle_index as random sampler)
+__constant__ int d_ncases ;        // Number of cases
+__constant__ unsigned int d_rng_seed ; // Key for random sampling; see RNG.H
 __constant__ int d_n_inputs ;      // Number of inputs (size of visible, bottom layer)
 __constant__ int d_n_inputs_cols ; // Ditto, extended to multiple of 128 bytes
 __constant__ int d_nhid ;          // Number of hidden neurons
 __constant__ int d_nhid_cols ;     // Ditto, extended to multiple of 128 bytes
 __constant__ int d_mean_field ;    // Use mean field instead of random sampling?
 __constant__ int d_greedy_mean_field ;    // Use mean field for greedy training?
+__constant__ int d_data_words ;    // Words per case in d_data_bits if the data are packed, else 0
 
-static       float *h_data = NULL ;
-__constant__ float *d_data ;
-static       float *h_data_mean = NULL ;
+__constant__ float *d_data ;       // These pointers equal the RBM_DEVICE members below
+__constant__ unsigned int *d_data_bits ;
 __constant__ float *d_data_mean ;
-static       float *h_in_bias = NULL ;
 __constant__ float *d_in_bias ;
-static       float *h_hid_bias = NULL ;
 __constant__ float *d_hid_bias ;
-static       float *h_w = NULL ;
 __constant__ float *d_w ;
-static       float *h_wtr = NULL ;
 __constant__ float *d_wtr ;
-
-static       int *h_shuffle_index = NULL ;
 __constant__ int *d_shuffle_index ;
-static       float *h_visible1 = NULL ;
 __constant__ float *d_visible1 ;
-static       float *h_visible2 = NULL ;
 __constant__ float *d_visible2 ;
-static       float *h_hidden1 = NULL ;
 __constant__ float *d_hidden1 ;
-static       float *h_hidden2 = NULL ;
 __constant__ float *d_hidden2 ;
-static       float *h_hidden_act = NULL ;
 __constant__ float *d_hidden_act ;
-static       float *h_in_bias_inc = NULL ;
 __constant__ float *d_in_bias_inc ;
-static       float *h_hid_bias_inc = NULL ;
 __constant__ float *d_hid_bias_inc ;
-static       float *h_hid_on_frac = NULL ;
 __constant__ float *d_hid_on_frac ;
-static       float *h_hid_on_smoothed = NULL ;
 __constant__ float *d_hid_on_smoothed ;
-static       float *h_w_inc = NULL ;
 __constant__ float *d_w_inc ;
-static       float *h_w_grad = NULL ;
 __constant__ float *d_w_grad ;
-static       float *h_prev_grad = NULL ;
 __constant__ float *d_prev_grad ;
-static       float *h_err_vec = NULL ;
 __constant__ float *d_err_vec ;
-static       float *h_len_out = NULL ;
 __constant__ float *d_len_out ;
-static       float *h_dot_out = NULL ;
 __constant__ float *d_dot_out ;
+__constant__ float *d_batch_sums ;
+__constant__ float *d_sums ;
 
 
 static cudaDeviceProp deviceProp ;
 
+
+/*
+   Everything on the host side that belongs to one device.  Each device has
+   its own copy of constant memory, so the d_ symbols above are set for each
+   one while it is current.  A single host thread drives all of the devices:
+   every launch and copy is asynchronous on the device's own stream, so after
+   rbm_cuda_select() the routines below simply address dev.
+
+   All kernels run on rbm_stream so that a whole batch can be captured as a graph.
+   It is a blocking stream, so the plain cudaMemcpy calls still wait for it.
+   Results of the captured batch come back through pinned memory.
+
+   Training state never leaves the device between batches.  The only host traffic
+   per epoch is the shuffle going down and the max weight for the convergence test
+   coming back, both through pinned memory and queued on rbm_stream.
+   The exception is a streamed dataset (see stream_stage), whose batches come
+   down on copy_stream.
+*/
+
+typedef struct {
+   float *h_data ;
+   unsigned int *h_data_bits ;  // Or if packed, bit j%32 of word j/32 of a case is input j; ncases by data_words
+   int data_words ;             // Words per case if packed, else 0
+   float *h_data_mean ;
+   float *h_in_bias ;
+   float *h_hid_bias ;
+   float *h_w ;
+   float *h_wtr ;
+   int *h_shuffle_index ;
+   float *h_visible1 ;
+   float *h_visible2 ;
+   float *h_hidden1 ;
+   float *h_hidden2 ;
+   float *h_hidden_act ;
+   float *h_in_bias_inc ;
+   float *h_hid_bias_inc ;
+   float *h_hid_on_frac ;
+   float *h_hid_on_smoothed ;
+   float *h_w_inc ;
+   float *h_w_grad ;
+   float *h_prev_grad ;
+   float *h_err_vec ;
+   float *h_len_out ;
+   float *h_dot_out ;
+   float *h_batch_sums ;        // The batch's error, max_inc, len and dot, finished on the device
+   float *h_sums ;              // Raw batch sums for the all-reduce; several devices only
+   float *h_peer ;              // Device 0 receives the other devices' sums here
+   cudaStream_t rbm_stream ;
+   cudaGraphExec_t batch_exec ;
+   float *batch_out ;           // Pinned copy of h_batch_sums
+   int *shuffle_pinned ;        // Staging for cuda_shuffle_to_device, ncases long
+   float *snap_out ;            // Block maxima from cuda_snapshot_max_w, REDUC_BLOCKS long
+   int snap_blocks ;            // Number of them in use
+   cudaEvent_t snap_event ;
+   float *state_pinned ;        // Training state from cuda_snapshot_state; device 0 only, made when first needed
+   cudaEvent_t state_event ;
+   cudaEvent_t sum_event ;      // Marks this device's sums (or device 0's total) ready
+   int streaming ;              // Data left on the host and staged a batch at a time?
+   float *stage_pinned[2] ;     // Host side of the two staging slots, max_batch * n_inputs each
+   float *stage[2] ;            // Device side of them
+   int stage_start[2] ;         // Epoch positions each slot holds, -1 if none
+   int stage_stop[2] ;
+   int stage_next ;             // Slot to fill next
+   int stage_cur ;              // Slot that cuda_fetch_vis1 reads
+   cudaStream_t copy_stream ;   // Non-blocking, so uploads overlap rbm_stream
+   cudaEvent_t stage_copied[2] ; // Slot's upload is complete
+   cudaEvent_t stage_used[2] ;  // Slot's last reader is complete
+#if RBM_CUBLAS
+   cublasHandle_t cublas_handle ;
+   void *cublas_work ;          // RBM_CUBLAS_WORKSPACE bytes, the handle's workspace
+#endif
+} RBM_DEVICE ;
+
+static int n_devices = 0 ;                  // Number initialized by rbm_cuda_init
+static int n_sums ;                         // Length of each h_sums
+static RBM_DEVICE devices[RBM_MAX_GPUS] ;
+static RBM_DEVICE *dev = devices ;
+
+
+/*
+   With several devices the three update kernels run twice.  The first pass
+   (RBM_UPDATE_SUM) leaves this device's raw sums in d_sums, and the second
+   (RBM_UPDATE_APPLY) applies the totals after the all-reduce.  A single
+   device does both at once (RBM_UPDATE_ALL).  The wrappers pass update_phase
+   to the kernels so that their signatures need not change.
+*/
+
+#define RBM_UPDATE_ALL   0
+#define RBM_UPDATE_SUM   1
+#define RBM_UPDATE_APPLY 2
+
+static int update_phase = RBM_UPDATE_ALL ;
+
+
+/*
+   If every input is 0 or 1 (and RBM_BINARY), a device that holds the data
+   keeps it as bits, a 32nd of the floats.  Cuda_fetch_vis1 expands a batch
+   into visible1 as usual; sampling leaves 0/1 values as they are, so
+   cuda_vis_to_hid can add the w_tr rows of the inputs that are on instead
+   of doing the product.  A device that streams uses floats.
+*/
+
+static int data_binary ;              // Set by rbm_cuda_init
+
+
+/*
+   A streamed dataset stays in the caller's array; batches are gathered
+   from it in shuffled order.  in_capture tells cuda_fetch_vis1 that
+   cuda_rbm_batch has already made rbm_stream wait for the batch.
+*/
+
+static double *stream_data = NULL ;
+static int stream_ncols ;
+static int stream_n_inputs ;
+static int stream_next_start = -1 ;         // Batch to prefetch, from rbm_cuda_stream_next
+static int stream_next_stop ;
+static int in_capture = 0 ;
+
+/*
+   Kernel scopes for PROFILE.H.  Events recorded while cuda_rbm_batch is
+   capturing its graph cannot be timed, so there the graph launch is
+   timed as one scope instead.
+*/
+
+#if PROFILE
+#define KERNEL_BEGIN(name) if (! in_capture) PROF_CUDA_BEGIN ( name , PROF_CAT_KERNEL , dev->rbm_stream )
+#define KERNEL_END()       if (! in_capture) PROF_CUDA_END ( dev->rbm_stream )
+#else
+#define KERNEL_BEGIN(name)
+#define KERNEL_END()
+#endif
+
 // Function declarations
 
 __global__ void device_recon_error ( int nc ) ;
-__global__ void device_fetch_vis1 ( int istart , int random_offset ) ;
-__global__ void device_vis_to_hid ( int nc ) ;
-__global__ void device_hid_to_vis ( int nc , int random_offset ) ;
+__global__ void device_fetch_vis1 ( int istart , unsigned int rng_draw , float *batch ) ;
+__global__ void device_vis_to_hid ( int nc , int istart , unsigned int rng_draw , int sample ) ;
+__global__ void device_vis_to_hid_bits ( int istart , unsigned int rng_draw , int sample ) ;
+__global__ void device_hid_to_vis ( int nc , int istart , unsigned int rng_draw ) ;
 __global__ void device_hid_to_vis_direct ( int nc ) ;
-__global__ void device_vis2_to_hid2 ( int nc ) ;
-__global__ void device_sample_hidden2 ( int nc , int random_offset ) ;
+__global__ void device_vis2_to_hid2 ( int nc , int istart , unsigned int rng_draw , int sample ) ;
+__global__ void device_sample_hidden2 ( int nc , int istart , unsigned int rng_draw ) ;
 __global__ void device_len_dot () ;
+__global__ void device_batch_sums ( int n_blocks , int which ) ;
 __global__ void device_max_inc ( int inc_vs_w ) ;
-__global__ void device_update_in_bias ( int nc , float rate , float momentum ) ;
-__global__ void device_update_hid_bias ( int nc , float rate , float momentum , int random_offset , float sparse_pen , float sparse_targ ) ;
-__global__ void device_update_weights ( int nc , float rate , float momentum , float weight_pen , float sparse_pen , float sparse_targ ) ;
+__global__ void device_update_in_bias ( int nc , float rate , float momentum , int phase ) ;
+__global__ void device_update_hid_bias ( int nc , float rate , float momentum , int istart , unsigned int rng_draw , float sparse_pen , float sparse_targ , int phase ) ;
+__global__ void device_update_weights ( int nc , float rate , float momentum , float weight_pen , float sparse_pen , float sparse_targ , int phase ) ;
+__global__ void device_add_sums ( int n , float *src ) ;
 __global__ void device_transpose () ;
 
 
+/*
+--------------------------------------------------------------------------------
+
+   Matrix products
+
+   The visible-to-hidden, hidden-to-visible, and weight gradient steps are
+   all matrix products over a batch.  Each block computes an MM_TILE square
+   of the output from MM_TILE square tiles of the operands staged in shared
+   memory, so every global value is read once per tile instead of once per
+   output.  Each thread accumulates MM_TILE/MM_ROWS outputs in one column.
+   The kernels then finish their own outputs (bias, logistic, sampling,
+   update) while the sums are still in registers.
+
+   With RBM_CUBLAS the product is done by cublasSgemm (optionally on the
+   TF32 tensor cores) into the destination array, and the same kernels
+   then run only their finishing step, reading the sums back.
+
+   All matrices are row major.  C (m by n) = op(A) * B, where op(A) is m by k
+   and A is stored k by m if trans_a is nonzero.
+
+--------------------------------------------------------------------------------
+*/
+
+#define MM_TILE 32     // Output tile is MM_TILE square; blockDim.x = MM_TILE
+#define MM_ROWS 8      // blockDim.y; each thread does MM_TILE / MM_ROWS outputs
+#define MM_PER_THREAD (MM_TILE / MM_ROWS)
+
+// acc[j] is for row row0 + threadIdx.y + j * MM_ROWS, column col0 + threadIdx.x
+// Every thread of the block must call this, even those outside the matrix.
+
+__device__ __forceinline__ void mm_tile (
+   int trans_a , const float *a , int lda , const float *b , int ldb ,
+   int m , int n , int k , int row0 , int col0 , float *acc )
+{
+   __shared__ float a_tile[MM_TILE][MM_TILE+1] ;   // Padded to avoid bank conflicts
+   __shared__ float b_tile[MM_TILE][MM_TILE+1] ;
+   int j, p, kk, r, row, col, tx, ty ;
+   float bval ;
+
+   tx = threadIdx.x ;
+   ty = threadIdx.y ;
+
+   for (j=0 ; j<MM_PER_THREAD ; j++)
+      acc[j] = 0.0f ;
+
+   for (kk=0 ; kk<k ; kk+=MM_TILE) {
+      for (r=ty ; r<MM_TILE ; r+=MM_ROWS) {
+         if (trans_a) {            // Read along rows of A (the m direction) for coalescing
+            row = kk + r ;
+            col = row0 + tx ;
+            a_tile[tx][r] = (row < k  &&  col < m)  ?  a[row*lda+col] : 0.0f ;
+            }
+         else {
+            row = row0 + r ;
+            col = kk + tx ;
+            a_tile[r][tx] = (row < m  &&  col < k)  ?  a[row*lda+col] : 0.0f ;
+            }
+         row = kk + r ;
+         col = col0 + tx ;
+         b_tile[r][tx] = (row < k  &&  col < n)  ?  b[row*ldb+col] : 0.0f ;
+         }
+      __syncthreads() ;
+
+      for (p=0 ; p<MM_TILE ; p++) {
+         bval = b_tile[p][tx] ;
+         for (j=0 ; j<MM_PER_THREAD ; j++)
+            acc[j] += a_tile[ty+j*MM_ROWS][p] * bval ;
+         }
+      __syncthreads() ;
+      }
+}
+
+// The product is already in c; fetch this thread's share of the tile
+
+__device__ __forceinline__ void mm_fetch (
+   const float *c , int ldc , int m , int n , int row0 , int col0 , float *acc )
+{
+   int j, row, col ;
+
+   col = col0 + threadIdx.x ;
+   for (j=0 ; j<MM_PER_THREAD ; j++) {
+      row = row0 + threadIdx.y + j * MM_ROWS ;
+      acc[j] = (row < m  &&  col < n)  ?  c[row*ldc+col] : 0.0f ;
+      }
+}
+
+#if RBM_CUBLAS
+
+// Row-major C = alpha * op(A) * B + beta * C is column-major C' = B' * op(A)',
+// so cuBLAS gets the operands swapped and no transposes are needed.
+
+static int mm_cublas (
+   const char *caller , int trans_a , int m , int n , int k , float alpha ,
+   const float *a , int lda , const float *b , int ldb , float beta , float *c , int ldc )
+{
+   char msg[256] ;
+   cublasStatus_t stat ;
+
+   stat = cublasSgemm ( dev->cublas_handle , CUBLAS_OP_N , trans_a ? CUBLAS_OP_T : CUBLAS_OP_N ,
+                        n , m , k , &alpha , b , ldb , a , lda , &beta , c , ldc ) ;
+   if (stat != CUBLAS_STATUS_SUCCESS) {
+      sprintf_s ( msg , 255 , "%s cublasSgemm error %d", caller, (int) stat ) ;
+      audit ( msg ) ;
+      return 1 ;
+      }
+   return 0 ;
+}
+#endif
+
+static void mm_launch_dims ( int m , int n , dim3 *grid , dim3 *block )
+{
+   block->x = MM_TILE ;
+   block->y = MM_ROWS ;
+   block->z = 1 ;
+   grid->x = (n + MM_TILE - 1) / MM_TILE ;
+   grid->y = (m + MM_TILE - 1) / MM_TILE ;
+   grid->z = 1 ;
+}
+
+
 /*
 --------------------------------------------------------------------------------
 
@@ -136,18 +398,122 @@ __global__ void device_transpose () ;
    It is freed here, immediately after use, in most routines, but then
    permanently allocated as a last step.
 
+   With n_gpus above one, every device gets the complete data and its own
+   copy of the parameters, and cuda_rbm_batch() splits each batch among
+   them.  Each device holds only its share of a batch, so max_batch is
+   divided here.  Peer access is enabled where the hardware allows it;
+   elsewhere the peer copies are staged through the host by the driver.
+
 --------------------------------------------------------------------------------
 */
 
+static int rbm_cuda_init_device ( int idev , int n_gpus , int ncases , int ncols , int n_inputs , int nhid ,
+                                  int mean_field , int greedy_mean_field , int max_batch ,
+                                  unsigned int rng_seed , double *data , double *data_mean ,
+                                  double *in_bias , double *hid_bias , double *w , char *error_msg ) ;
+
+int rbm_cuda_max_devices ()
+{
+   int n ;
+
+   if (cudaGetDeviceCount ( &n ) != cudaSuccess  ||  n < 1)
+      n = 1 ;                 // Let rbm_cuda_init report the failure
+   if (n > RBM_MAX_GPUS)
+      n = RBM_MAX_GPUS ;
+   return n ;
+}
+
+static void rbm_cuda_select ( int idev )
+{
+   dev = &devices[idev] ;
+   cudaSetDevice ( idev ) ;
+}
 
 int rbm_cuda_init (
-   int ncases ,            // Number of cases, needed for using shuffle_index for random sampling
+   int ncases ,            // Number of cases
    int ncols ,             // Number of columns in data (may exceed n_inputs)
    int n_inputs ,          // Number of inputs
    int nhid ,              // Number of hidden neurons
    int mean_field ,        // Use mean field instead of random sampling?
    int greedy_mean_field , // Use mean field for greedy training?
    int max_batch ,         // Max size of any batch
+   unsigned int rng_seed , // Key for random sampling, the same one the host code would use
+   int n_gpus ,            // Number of devices, at most rbm_cuda_max_devices() and max_batch
+   double *data ,          // Input data, ncases rows by ncols columns
+   double *data_mean ,     // Mean of each input, needed for weight sparsity penalty
+   double *in_bias ,       // Input bias vector
+   double *hid_bias ,      // Hidden bias vector
+   double *w ,             // Weight matrix
+   char *error_msg         // Returns text of error if problem
+   )
+{
+   int i, j, idev, jdev, can_access, ret_val ;
+   char msg[256] ;
+
+   MEMTEXT ( "RBM.cu: rbm_cuda_init starting" ) ;
+
+   data_binary = RBM_BINARY ;
+   for (i=0 ; i<ncases  &&  data_binary ; i++) {
+      for (j=0 ; j<n_inputs ; j++) {
+         if (data[i*ncols+j] != 0.0  &&  data[i*ncols+j] != 1.0) {
+            data_binary = 0 ;
+            break ;
+            }
+         }
+      }
+
+   n_sums = (n_inputs + 31) / 32 * 32 * nhid + n_inputs + 2 * nhid ;
+   stream_data = data ;
+   stream_ncols = ncols ;
+   stream_n_inputs = n_inputs ;
+   stream_next_start = -1 ;
+   max_batch = (max_batch + n_gpus - 1) / n_gpus ;   // Largest share of a batch
+
+   n_devices = 0 ;
+   ret_val = 0 ;
+   for (idev=0 ; idev<n_gpus ; idev++) {
+      n_devices = idev + 1 ;  // So that cleanup frees a partly initialized device
+      ret_val = rbm_cuda_init_device ( idev , n_gpus , ncases , ncols , n_inputs , nhid , mean_field ,
+                                       greedy_mean_field , max_batch , rng_seed , data , data_mean ,
+                                       in_bias , hid_bias , w , error_msg ) ;
+      if (ret_val)
+         break ;
+      }
+
+   for (idev=0 ; idev<n_devices  &&  ! ret_val ; idev++) {
+      rbm_cuda_select ( idev ) ;
+      for (jdev=0 ; jdev<n_devices ; jdev++) {
+         if (jdev == idev  ||  cudaDeviceCanAccessPeer ( &can_access , idev , jdev ) != cudaSuccess  ||  ! can_access)
+            continue ;
+         if (cudaDeviceEnablePeerAccess ( jdev , 0 ) == cudaSuccess) {
+            sprintf_s ( msg , 255 , "CUDA device %d can access device %d directly", idev, jdev ) ;
+            MEMTEXT ( msg ) ;
+            }
+         else
+            cudaGetLastError () ;   // Not fatal; copies go through the host
+         }
+      }
+
+   rbm_cuda_select ( 0 ) ;
+
+   if (ret_val == 0) {
+      MEMTEXT ( "RBM.cu: rbm_cuda_init finished" ) ;
+      }
+   return ret_val ;
+}
+
+
+static int rbm_cuda_init_device (
+   int idev ,              // Which device
+   int n_gpus ,            // Of how many
+   int ncases ,            // Number of cases
+   int ncols ,             // Number of columns in data (may exceed n_inputs)
+   int n_inputs ,          // Number of inputs
+   int nhid ,              // Number of hidden neurons
+   int mean_field ,        // Use mean field instead of random sampling?
+   int greedy_mean_field , // Use mean field for greedy training?
+   int max_batch ,         // Max size of this device's share of any batch
+   unsigned int rng_seed , // Key for random sampling, the same one the host code would use
    double *data ,          // Input data, ncases rows by ncols columns
    double *data_mean ,     // Mean of each input, needed for weight sparsity penalty
    double *in_bias ,       // Input bias vector
@@ -157,21 +523,33 @@ int rbm_cuda_init (
    )
 {
    int i, j, n_inputs_cols, nhid_cols ;
+   size_t free_mem, total_mem, work, data_size ;
+   unsigned int *bits ;
    char msg[256] ;
    cudaError_t error_id ;
 
-   MEMTEXT ( "RBM.cu: rbm_cuda_init starting" ) ;
+   dev = &devices[idev] ;
+   memset ( dev , 0 , sizeof(RBM_DEVICE) ) ;
+
+   if (fdata != NULL) {       // Left permanently allocated by the prior device
+      FREE ( fdata ) ;
+      fdata = NULL ;
+      }
+   if (reduc_fdata != NULL) {
+      FREE ( reduc_fdata ) ;
+      reduc_fdata = NULL ;
+      }
 
-   error_id = cudaSetDevice ( 0 ) ;
+   error_id = cudaSetDevice ( idev ) ;
    if (error_id  !=  cudaSuccess) {
-      sprintf_s ( error_msg , 255 , "CUDA init SetDevice failed %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      sprintf_s ( error_msg , 255 , "CUDA init SetDevice %d failed %d: %s", idev, error_id, cudaGetErrorString(error_id) ) ;
       MEMTEXT ( error_msg ) ;
       audit ( error_msg ) ;
       cuda_enable = 0 ;
       return ERROR_CUDA_ERROR ;
       }
 
-   cudaGetDeviceProperties ( &deviceProp , 0 ) ;
+   cudaGetDeviceProperties ( &deviceProp , idev ) ;  // Every device is assumed to have the same warp size
 
 /*
    Extend the size of matrices to make sure every row starts on a 128-byte cache-line boundary
@@ -188,6 +566,7 @@ int rbm_cuda_init (
 */
 
    cudaMemcpyToSymbol ( d_ncases , &ncases , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_rng_seed , &rng_seed , sizeof(unsigned int) , 0 , cudaMemcpyHostToDevice ) ;
    cudaMemcpyToSymbol ( d_n_inputs , &n_inputs , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
    cudaMemcpyToSymbol ( d_n_inputs_cols , &n_inputs_cols , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
    cudaMemcpyToSymbol ( d_nhid , &nhid , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;
@@ -198,35 +577,113 @@ int rbm_cuda_init (
 
 /*
    Data - We must extract only the (first) n_inputs columns from the ncols columns in data
-*/
 
-   fdata = (float *) MALLOC ( ncases * n_inputs * sizeof(float) ) ;
-   if (fdata == NULL)
-      return ERROR_INSUFFICIENT_MEMORY ;
+   If it would not leave room for the work areas below (roughly estimated,
+   with 64 MB to spare), or RBM_STREAM is set, it stays on the host and
+   each batch is staged through a pair of slots instead.
+   Binary data is tested at its packed size.
+*/
 
-   error_id = cudaMalloc ( (void **) &h_data , (size_t) (ncases * n_inputs * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC data = %llu", (unsigned long long) h_data ) ;
-   MEMTEXT ( msg ) ;
-   if (error_id  !=  cudaSuccess) {
-      sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc data (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
-      return ERROR_CUDA_MEMORY ;
+   work = sizeof(float) * ((size_t) max_batch * (2 * n_inputs_cols + 4 * nhid_cols)
+                          + (size_t) 7 * n_inputs_cols * nhid_cols) + ncases * sizeof(int) + ((size_t) 64 << 20) ;
+
+   dev->data_words = data_binary  ?  (n_inputs + 31) / 32 : 0 ;
+   data_size = (size_t) ncases * (dev->data_words  ?  dev->data_words * sizeof(unsigned int) : n_inputs * sizeof(float)) ;
+
+   dev->streaming = RBM_STREAM ;
+   if (! dev->streaming  &&  cudaMemGetInfo ( &free_mem , &total_mem ) == cudaSuccess)
+      dev->streaming = data_size + work > free_mem ;
+   if (dev->streaming)
+      dev->data_words = 0 ;
+   cudaMemcpyToSymbol ( d_data_words , &dev->data_words , sizeof(int) , 0 , cudaMemcpyHostToDevice ) ;  // Constants outlive a prior init
+
+   if (dev->streaming) {
+      sprintf_s ( msg, 255 , "CUDA device %d streams the data from the host", idev ) ;
+      MEMTEXT ( msg ) ;
+      error_id = cudaStreamCreateWithFlags ( &dev->copy_stream , cudaStreamNonBlocking ) ;
+      for (i=0 ; i<2 ; i++) {
+         dev->stage_start[i] = dev->stage_stop[i] = -1 ;
+         if (error_id == cudaSuccess)
+            error_id = cudaMallocHost ( (void **) &dev->stage_pinned[i] , (size_t) max_batch * n_inputs * sizeof(float) ) ;
+         if (error_id == cudaSuccess)
+            error_id = cudaMalloc ( (void **) &dev->stage[i] , (size_t) max_batch * n_inputs * sizeof(float) ) ;
+         if (error_id == cudaSuccess)
+            error_id = cudaEventCreateWithFlags ( &dev->stage_copied[i] , cudaEventDisableTiming ) ;
+         if (error_id == cudaSuccess)
+            error_id = cudaEventCreateWithFlags ( &dev->stage_used[i] , cudaEventDisableTiming ) ;
+         }
+      if (error_id  !=  cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA init bad staging allocation (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_MEMORY ;
+         }
       }
 
-   for (i=0 ; i<ncases ; i++) {
-      for (j=0 ; j<n_inputs ; j++)
-         fdata[i*n_inputs+j] = (float) data[i*ncols+j] ;
+   else if (dev->data_words) {
+      sprintf_s ( msg, 255 , "CUDA device %d holds the binary data as bits", idev ) ;
+      MEMTEXT ( msg ) ;
+
+      bits = (unsigned int *) MALLOC ( data_size ) ;
+      if (bits == NULL)
+         return ERROR_INSUFFICIENT_MEMORY ;
+
+      error_id = cudaMalloc ( (void **) &dev->h_data_bits , data_size ) ;
+      sprintf_s ( msg, 255 , "CUDA MALLOC data bits = %llu", (unsigned long long) dev->h_data_bits ) ;
+      MEMTEXT ( msg ) ;
+      if (error_id  !=  cudaSuccess) {
+         FREE ( bits ) ;
+         sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc data bits (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_MEMORY ;
+         }
+
+      memset ( bits , 0 , data_size ) ;
+      for (i=0 ; i<ncases ; i++) {
+         for (j=0 ; j<n_inputs ; j++) {
+            if (data[i*ncols+j] != 0.0)
+               bits[i*dev->data_words+j/32] |= 1u << (j % 32) ;
+            }
+         }
+
+      error_id = cudaMemcpy ( dev->h_data_bits , bits , data_size , cudaMemcpyHostToDevice ) ;
+      FREE ( bits ) ;
+
+      if (error_id == cudaSuccess)
+         error_id = cudaMemcpyToSymbol ( d_data_bits , &dev->h_data_bits , sizeof(unsigned int *) , 0 , cudaMemcpyHostToDevice ) ;
+
+      if (error_id  !=  cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA init bad data bits copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_ERROR ;
+         }
       }
 
-   error_id = cudaMemcpy ( h_data , fdata , ncases * n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
-   FREE ( fdata ) ;
-   fdata = NULL ;
+   else {
+      fdata = (float *) MALLOC ( ncases * n_inputs * sizeof(float) ) ;
+      if (fdata == NULL)
+         return ERROR_INSUFFICIENT_MEMORY ;
+
+      error_id = cudaMalloc ( (void **) &dev->h_data , (size_t) (ncases * n_inputs * sizeof(float)) ) ;
+      sprintf_s ( msg, 255 , "CUDA MALLOC data = %llu", (unsigned long long) dev->h_data ) ;
+      MEMTEXT ( msg ) ;
+      if (error_id  !=  cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc data (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_MEMORY ;
+         }
 
-   if (error_id == cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_data , &h_data , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+      for (i=0 ; i<ncases ; i++) {
+         for (j=0 ; j<n_inputs ; j++)
+            fdata[i*n_inputs+j] = (float) data[i*ncols+j] ;
+         }
 
-   if (error_id  !=  cudaSuccess) {
-      sprintf_s ( error_msg , 255 , "CUDA init bad data copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
-      return ERROR_CUDA_ERROR ;
+      error_id = cudaMemcpy ( dev->h_data , fdata , ncases * n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      FREE ( fdata ) ;
+      fdata = NULL ;
+
+      if (error_id == cudaSuccess)
+         error_id = cudaMemcpyToSymbol ( d_data , &dev->h_data , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+
+      if (error_id  !=  cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA init bad data copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_ERROR ;
+         }
       }
 
 
@@ -238,8 +695,8 @@ int rbm_cuda_init (
    if (fdata == NULL)
       return ERROR_INSUFFICIENT_MEMORY ;
 
-   error_id = cudaMalloc ( (void **) &h_data_mean , (size_t) (n_inputs * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC data_mean = %llu", (unsigned long long) h_data_mean ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_data_mean , (size_t) (n_inputs * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC data_mean = %llu", (unsigned long long) dev->h_data_mean ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc data_mean (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -249,12 +706,12 @@ int rbm_cuda_init (
    for (i=0 ; i<n_inputs ; i++)
       fdata[i] = (float) data_mean[i] ;
 
-   error_id = cudaMemcpy ( h_data_mean , fdata , n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_data_mean , fdata , n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
    FREE ( fdata ) ;
    fdata = NULL ;
 
    if (error_id == cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_data_mean , &h_data_mean , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_data_mean , &dev->h_data_mean , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad data_mean copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -270,8 +727,8 @@ int rbm_cuda_init (
    if (fdata == NULL)
       return ERROR_INSUFFICIENT_MEMORY ;
 
-   error_id = cudaMalloc ( (void **) &h_in_bias , (size_t) (n_inputs * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC in_bias = %llu", (unsigned long long) h_in_bias ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_in_bias , (size_t) (n_inputs * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC in_bias = %llu", (unsigned long long) dev->h_in_bias ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc in_bias (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -281,12 +738,12 @@ int rbm_cuda_init (
    for (i=0 ; i<n_inputs ; i++)
       fdata[i] = (float) in_bias[i] ;
 
-   error_id = cudaMemcpy ( h_in_bias , fdata , n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_in_bias , fdata , n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
    FREE ( fdata ) ;
    fdata = NULL ;
 
    if (error_id == cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_in_bias , &h_in_bias , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_in_bias , &dev->h_in_bias , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad in_bias copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -302,8 +759,8 @@ int rbm_cuda_init (
    if (fdata == NULL)
       return ERROR_INSUFFICIENT_MEMORY ;
 
-   error_id = cudaMalloc ( (void **) &h_hid_bias , (size_t) (nhid * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC hid_bias = %llu", (unsigned long long) h_hid_bias ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_hid_bias , (size_t) (nhid * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC hid_bias = %llu", (unsigned long long) dev->h_hid_bias ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc hid_bias (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -313,12 +770,12 @@ int rbm_cuda_init (
    for (i=0 ; i<nhid ; i++)
       fdata[i] = (float) hid_bias[i] ;
 
-   error_id = cudaMemcpy ( h_hid_bias , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_hid_bias , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
    FREE ( fdata ) ;
    fdata = NULL ;
 
    if (error_id == cudaSuccess)
-      error_id = cudaMemcpyToSymbol ( d_hid_bias , &h_hid_bias , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_hid_bias , &dev->h_hid_bias , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad hid_bias copy %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -334,16 +791,16 @@ int rbm_cuda_init (
    if (fdata == NULL)
       return ERROR_INSUFFICIENT_MEMORY ;
 
-   error_id = cudaMalloc ( (void **) &h_w , (size_t) (n_inputs_cols * nhid * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC w = %llu", (unsigned long long) h_w ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_w , (size_t) (n_inputs_cols * nhid * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC w = %llu", (unsigned long long) dev->h_w ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc w (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
 
-   error_id = cudaMalloc ( (void **) &h_wtr , (size_t) (n_inputs * nhid_cols * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC wtr = %llu", (unsigned long long) h_wtr ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_wtr , (size_t) (n_inputs * nhid_cols * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC wtr = %llu", (unsigned long long) dev->h_wtr ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc wtr (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -357,7 +814,7 @@ int rbm_cuda_init (
          fdata[j*n_inputs_cols+i] = 0.0f ;
       }
 
-   error_id = cudaMemcpy ( h_w , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_w , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
 
    if (error_id == cudaSuccess) {
       for (i=0 ; i<n_inputs ; i++) {
@@ -366,15 +823,15 @@ int rbm_cuda_init (
          for ( ; j<nhid_cols ; j++)
             fdata[i*nhid_cols+j] = 0.0f ;
          }
-      error_id = cudaMemcpy ( h_wtr , fdata , n_inputs * nhid_cols * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_wtr , fdata , n_inputs * nhid_cols * sizeof(float) , cudaMemcpyHostToDevice ) ;
       }
    
    FREE ( fdata ) ;
    fdata = NULL ;
 
    if (error_id == cudaSuccess) {
-      error_id = cudaMemcpyToSymbol ( d_w , &h_w , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
-      error_id = cudaMemcpyToSymbol ( d_wtr , &h_wtr , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_w , &dev->h_w , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpyToSymbol ( d_wtr , &dev->h_wtr , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
       }
 
    if (error_id  !=  cudaSuccess) {
@@ -387,149 +844,173 @@ int rbm_cuda_init (
    Vector work areas that are not initialized here
 */
 
-   error_id = cudaMalloc ( (void **) &h_shuffle_index , (size_t) (ncases * sizeof(int)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC shuffle_index = %llu", (unsigned long long) h_shuffle_index ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_shuffle_index , (size_t) (ncases * sizeof(int)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC shuffle_index = %llu", (unsigned long long) dev->h_shuffle_index ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc shuffle_index (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_shuffle_index , &h_shuffle_index , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_shuffle_index , &dev->h_shuffle_index , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_visible1 , (size_t) (max_batch * n_inputs_cols * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC visible1 = %llu", (unsigned long long) h_visible1 ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_visible1 , (size_t) (max_batch * n_inputs_cols * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC visible1 = %llu", (unsigned long long) dev->h_visible1 ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc visible1 (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_visible1 , &h_visible1 , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_visible1 , &dev->h_visible1 , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_visible2 , (size_t) (max_batch * n_inputs_cols * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC visible2 = %llu", (unsigned long long) h_visible2 ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_visible2 , (size_t) (max_batch * n_inputs_cols * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC visible2 = %llu", (unsigned long long) dev->h_visible2 ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc visible2 (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_visible2 , &h_visible2 , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_visible2 , &dev->h_visible2 , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_hidden1 , (size_t) (max_batch * nhid_cols * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC hidden1 = %llu", (unsigned long long) h_hidden1 ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_hidden1 , (size_t) (max_batch * nhid_cols * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC hidden1 = %llu", (unsigned long long) dev->h_hidden1 ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc hidden1 (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_hidden1 , &h_hidden1 , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_hidden1 , &dev->h_hidden1 , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_hidden2 , (size_t) (max_batch * nhid_cols * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC hidden2 = %llu", (unsigned long long) h_hidden2 ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_hidden2 , (size_t) (max_batch * nhid_cols * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC hidden2 = %llu", (unsigned long long) dev->h_hidden2 ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc hidden2 (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_hidden2 , &h_hidden2 , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_hidden2 , &dev->h_hidden2 , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_hidden_act , (size_t) (max_batch * nhid_cols * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC hidden_act = %llu", (unsigned long long) h_hidden_act ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_hidden_act , (size_t) (max_batch * nhid_cols * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC hidden_act = %llu", (unsigned long long) dev->h_hidden_act ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc hidden_act (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_hidden_act , &h_hidden_act , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_hidden_act , &dev->h_hidden_act , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_hid_on_frac , (size_t) (max_batch * nhid_cols * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC hid_on_frac = %llu", (unsigned long long) h_hid_on_frac ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_hid_on_frac , (size_t) (max_batch * nhid_cols * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC hid_on_frac = %llu", (unsigned long long) dev->h_hid_on_frac ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc hid_on_frac (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_hid_on_frac , &h_hid_on_frac , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_hid_on_frac , &dev->h_hid_on_frac , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_in_bias_inc , (size_t) (n_inputs * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC in_bias_inc = %llu", (unsigned long long) h_in_bias_inc ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_in_bias_inc , (size_t) (n_inputs * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC in_bias_inc = %llu", (unsigned long long) dev->h_in_bias_inc ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc in_bias_inc (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_in_bias_inc , &h_in_bias_inc , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_in_bias_inc , &dev->h_in_bias_inc , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_hid_bias_inc , (size_t) (nhid * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC hid_bias_inc = %llu", (unsigned long long) h_hid_bias_inc ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_hid_bias_inc , (size_t) (nhid * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC hid_bias_inc = %llu", (unsigned long long) dev->h_hid_bias_inc ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc hid_bias_inc (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_hid_bias_inc , &h_hid_bias_inc , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_hid_bias_inc , &dev->h_hid_bias_inc , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_hid_on_smoothed , (size_t) (nhid * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC hid_on_smoothed = %llu", (unsigned long long) h_hid_on_smoothed ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_hid_on_smoothed , (size_t) (nhid * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC hid_on_smoothed = %llu", (unsigned long long) dev->h_hid_on_smoothed ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc hid_on_smoothed (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_hid_on_smoothed , &h_hid_on_smoothed , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_hid_on_smoothed , &dev->h_hid_on_smoothed , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_w_inc , (size_t) (n_inputs_cols * nhid * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC w_inc = %llu", (unsigned long long) h_w_inc ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_w_inc , (size_t) (n_inputs_cols * nhid * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC w_inc = %llu", (unsigned long long) dev->h_w_inc ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc w_inc (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_w_inc , &h_w_inc , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_w_inc , &dev->h_w_inc , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_w_grad , (size_t) (n_inputs_cols * nhid * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC w_grad = %llu", (unsigned long long) h_w_grad ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_w_grad , (size_t) (n_inputs_cols * nhid * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC w_grad = %llu", (unsigned long long) dev->h_w_grad ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc w_grad (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_w_grad , &h_w_grad , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_w_grad , &dev->h_w_grad , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_prev_grad , (size_t) (n_inputs_cols * nhid * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC prev_grad = %llu", (unsigned long long) h_prev_grad ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_prev_grad , (size_t) (n_inputs_cols * nhid * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC prev_grad = %llu", (unsigned long long) dev->h_prev_grad ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc prev_grad (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_prev_grad , &h_prev_grad , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_prev_grad , &dev->h_prev_grad , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_err_vec , (size_t) (n_inputs * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC err_vec = %llu", (unsigned long long) h_err_vec ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_err_vec , (size_t) (n_inputs * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC err_vec = %llu", (unsigned long long) dev->h_err_vec ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc err_vec (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_err_vec , &h_err_vec , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_err_vec , &dev->h_err_vec , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_len_out , (size_t) (REDUC_BLOCKS * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC len_out = %llu", (unsigned long long) h_len_out ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_len_out , (size_t) (REDUC_BLOCKS * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC len_out = %llu", (unsigned long long) dev->h_len_out ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc len_out (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_len_out , &h_len_out , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_len_out , &dev->h_len_out , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
 
-   error_id = cudaMalloc ( (void **) &h_dot_out , (size_t) (REDUC_BLOCKS * sizeof(float)) ) ;
-   sprintf_s ( msg, 255 , "CUDA MALLOC dot_out = %llu", (unsigned long long) h_dot_out ) ;
+   error_id = cudaMalloc ( (void **) &dev->h_dot_out , (size_t) (REDUC_BLOCKS * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC dot_out = %llu", (unsigned long long) dev->h_dot_out ) ;
    MEMTEXT ( msg ) ;
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc dot_out (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
       return ERROR_CUDA_MEMORY ;
       }
-   cudaMemcpyToSymbol ( d_dot_out , &h_dot_out , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+   cudaMemcpyToSymbol ( d_dot_out , &dev->h_dot_out , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+
+   error_id = cudaMalloc ( (void **) &dev->h_batch_sums , (size_t) (RBM_N_BATCH_SUMS * sizeof(float)) ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC batch_sums = %llu", (unsigned long long) dev->h_batch_sums ) ;
+   MEMTEXT ( msg ) ;
+   if (error_id  !=  cudaSuccess) {
+      sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc batch_sums (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+      return ERROR_CUDA_MEMORY ;
+      }
+   cudaMemcpyToSymbol ( d_batch_sums , &dev->h_batch_sums , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+
+   if (n_gpus > 1) {
+      error_id = cudaMalloc ( (void **) &dev->h_sums , (size_t) (n_sums * sizeof(float)) ) ;
+      if (error_id  ==  cudaSuccess)   // The row padding is summed but never used; keep it finite
+         error_id = cudaMemset ( dev->h_sums , 0 , n_sums * sizeof(float) ) ;
+      if (error_id  ==  cudaSuccess  &&  idev == 0)
+         error_id = cudaMalloc ( (void **) &dev->h_peer , (size_t) (n_sums * sizeof(float)) ) ;
+      sprintf_s ( msg, 255 , "CUDA MALLOC sums = %llu", (unsigned long long) dev->h_sums ) ;
+      MEMTEXT ( msg ) ;
+      if (error_id  !=  cudaSuccess) {
+         sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc sums (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+         return ERROR_CUDA_MEMORY ;
+         }
+      cudaMemcpyToSymbol ( d_sums , &dev->h_sums , sizeof(void *) , 0 , cudaMemcpyHostToDevice ) ;
+      }
 
    MEMTEXT ( "CUDA init reduc_fdata" ) ;
    reduc_fdata = (float *) MALLOC ( REDUC_BLOCKS * sizeof(float) ) ;
@@ -538,6 +1019,51 @@ int rbm_cuda_init (
       return ERROR_CUDA_MEMORY ;  // New error return
       }
 
+   error_id = cudaStreamCreate ( &dev->rbm_stream ) ;
+   if (error_id  ==  cudaSuccess)
+      error_id = cudaMallocHost ( (void **) &dev->batch_out , RBM_N_BATCH_SUMS * sizeof(float) ) ;
+   if (error_id  ==  cudaSuccess)
+      error_id = cudaMallocHost ( (void **) &dev->shuffle_pinned , ncases * sizeof(int) ) ;
+   if (error_id  ==  cudaSuccess)
+      error_id = cudaMallocHost ( (void **) &dev->snap_out , REDUC_BLOCKS * sizeof(float) ) ;
+   if (error_id  ==  cudaSuccess)
+      error_id = cudaEventCreateWithFlags ( &dev->snap_event , cudaEventDisableTiming ) ;
+   if (error_id  ==  cudaSuccess)
+      error_id = cudaEventCreateWithFlags ( &dev->sum_event , cudaEventDisableTiming ) ;
+   if (error_id  !=  cudaSuccess) {
+      sprintf_s ( error_msg , 255 , "CUDA init bad stream or pinned memory (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+      return ERROR_CUDA_MEMORY ;
+      }
+
+#if RBM_CUBLAS
+   mm_n_inputs = n_inputs ;
+   mm_nhid = nhid ;
+   mm_mean_field = mean_field ;
+   if (cublasCreate ( &dev->cublas_handle ) != CUBLAS_STATUS_SUCCESS
+    || cublasSetStream ( dev->cublas_handle , dev->rbm_stream ) != CUBLAS_STATUS_SUCCESS
+#if RBM_TF32
+    || cublasSetMathMode ( dev->cublas_handle , CUBLAS_TF32_TENSOR_OP_MATH ) != CUBLAS_STATUS_SUCCESS
+#endif
+      ) {
+      sprintf_s ( error_msg , 255 , "CUDA init cuBLAS failed" ) ;
+      return ERROR_CUDA_ERROR ;
+      }
+
+   // After cublasSetStream, which resets the workspace to the library's own
+   error_id = cudaMalloc ( &dev->cublas_work , RBM_CUBLAS_WORKSPACE ) ;
+   sprintf_s ( msg, 255 , "CUDA MALLOC cublas_work = %llu", (unsigned long long) dev->cublas_work ) ;
+   MEMTEXT ( msg ) ;
+   if (error_id  !=  cudaSuccess) {
+      dev->cublas_work = NULL ;
+      sprintf_s ( error_msg , 255 , "CUDA init bad cudaMalloc cublas_work (%d): %s", error_id, cudaGetErrorString(error_id) ) ;
+      return ERROR_CUDA_MEMORY ;
+      }
+   if (cublasSetWorkspace ( dev->cublas_handle , dev->cublas_work , RBM_CUBLAS_WORKSPACE ) != CUBLAS_STATUS_SUCCESS) {
+      sprintf_s ( error_msg , 255 , "CUDA init cuBLAS workspace failed" ) ;
+      return ERROR_CUDA_ERROR ;
+      }
+#endif
+
 /*
    Initialize things to starting values
 */
@@ -549,20 +1075,20 @@ int rbm_cuda_init (
    for (i=0 ; i<n_inputs_cols * nhid_cols ; i++)
       fdata[i] = 0.0f ;
 
-   error_id = cudaMemcpy ( h_in_bias_inc , fdata , n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_in_bias_inc , fdata , n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
    if (error_id  ==  cudaSuccess)
-      error_id = cudaMemcpy ( h_hid_bias_inc , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_hid_bias_inc , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
    if (error_id  ==  cudaSuccess)
-      error_id = cudaMemcpy ( h_w_inc , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_w_inc , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
    if (error_id  ==  cudaSuccess)
-      error_id = cudaMemcpy ( h_w_grad , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_w_grad , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
    if (error_id  ==  cudaSuccess)
-      error_id = cudaMemcpy ( h_prev_grad , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_prev_grad , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
 
    if (error_id  ==  cudaSuccess) {
       for (i=0 ; i<nhid ; i++)
          fdata[i] = (float) 0.5 ;
-      error_id = cudaMemcpy ( h_hid_on_smoothed , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_hid_on_smoothed , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
       }
 
    if (error_id  !=  cudaSuccess) {
@@ -589,13 +1115,13 @@ int rbm_cuda_init (
    if (error_id == cudaSuccess)
       error_id = cudaFuncSetCacheConfig ( device_fetch_vis1 , cudaFuncCachePreferL1 ) ;
    if (error_id == cudaSuccess)
-      error_id = cudaFuncSetCacheConfig ( device_vis_to_hid , cudaFuncCachePreferL1 ) ;
+      error_id = cudaFuncSetCacheConfig ( device_vis_to_hid , cudaFuncCachePreferShared ) ;
    if (error_id == cudaSuccess)
-      error_id = cudaFuncSetCacheConfig ( device_hid_to_vis , cudaFuncCachePreferL1 ) ;
+      error_id = cudaFuncSetCacheConfig ( device_hid_to_vis , cudaFuncCachePreferShared ) ;
    if (error_id == cudaSuccess)
-      error_id = cudaFuncSetCacheConfig ( device_hid_to_vis_direct , cudaFuncCachePreferL1 ) ;
+      error_id = cudaFuncSetCacheConfig ( device_hid_to_vis_direct , cudaFuncCachePreferShared ) ;
    if (error_id == cudaSuccess)
-      error_id = cudaFuncSetCacheConfig ( device_vis2_to_hid2 , cudaFuncCachePreferL1 ) ;
+      error_id = cudaFuncSetCacheConfig ( device_vis2_to_hid2 , cudaFuncCachePreferShared ) ;
    if (error_id == cudaSuccess)
       error_id = cudaFuncSetCacheConfig ( device_sample_hidden2 , cudaFuncCachePreferL1 ) ;
    if (error_id == cudaSuccess)
@@ -607,7 +1133,7 @@ int rbm_cuda_init (
    if (error_id == cudaSuccess)
       error_id = cudaFuncSetCacheConfig ( device_update_hid_bias , cudaFuncCachePreferL1 ) ;
    if (error_id == cudaSuccess)
-      error_id = cudaFuncSetCacheConfig ( device_update_weights , cudaFuncCachePreferL1 ) ;
+      error_id = cudaFuncSetCacheConfig ( device_update_weights , cudaFuncCachePreferShared ) ;
    if (error_id == cudaSuccess)
       error_id = cudaFuncSetCacheConfig ( device_transpose , cudaFuncCachePreferL1 ) ;
    if (error_id  !=  cudaSuccess) {
@@ -615,7 +1141,6 @@ int rbm_cuda_init (
       return ERROR_CUDA_ERROR ;
       }
 
-   MEMTEXT ( "RBM.cu: rbm_cuda_init finished" ) ;
    return 0 ;
 }
 
@@ -625,6 +1150,11 @@ int rbm_cuda_init (
 
    shuffle_to_device - Copy the shuffle vector to the device
 
+   The copy is queued on rbm_stream ahead of the batches that use it, so the
+   host does not wait for it.  The pinned staging vector is free to reuse
+   because every batch of the prior epoch has already been synchronized.
+   Every device gets the whole vector, since each one indexes the full data.
+
 --------------------------------------------------------------------------------
 */
 
@@ -634,10 +1164,19 @@ int cuda_shuffle_to_device (
    int *shuffle_index
    )
 {
+   int idev ;
    char msg[256] ;
    cudaError_t error_id ;
 
-   error_id = cudaMemcpy ( h_shuffle_index , shuffle_index , ncases * sizeof(int) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaSuccess ;
+   for (idev=0 ; idev<n_devices  &&  error_id == cudaSuccess ; idev++) {
+      rbm_cuda_select ( idev ) ;
+      memcpy ( dev->shuffle_pinned , shuffle_index , ncases * sizeof(int) ) ;
+      dev->stage_start[0] = dev->stage_start[1] = -1 ;   // Staged batches were for the prior order
+      error_id = cudaMemcpyAsync ( dev->h_shuffle_index , dev->shuffle_pinned , ncases * sizeof(int) ,
+                                   cudaMemcpyHostToDevice , dev->rbm_stream ) ;
+      }
+   rbm_cuda_select ( 0 ) ;
 
    if (error_id  !=  cudaSuccess) {
       sprintf_s ( msg , 255 , "CUDA bad shuffle_to_device %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -653,7 +1192,7 @@ int cuda_shuffle_to_device (
 
    params_to_device - Copy the weights and biases to the device
                       This is called only by rbm_cuda_wt_init(),
-                      not by rbm_thr2().
+                      not by rbm_thr2(), and so only with one device.
 
 --------------------------------------------------------------------------------
 */
@@ -676,12 +1215,12 @@ int cuda_params_to_device (
 
    for (i=0 ; i<n_inputs ; i++)
       fdata[i] = (float) in_bias[i] ;
-   error_id = cudaMemcpy ( h_in_bias , fdata , n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
+   error_id = cudaMemcpy ( dev->h_in_bias , fdata , n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
 
    if (error_id  ==  cudaSuccess) {
       for (i=0 ; i<nhid ; i++)
          fdata[i] = (float) hid_bias[i] ;
-      error_id = cudaMemcpy ( h_hid_bias , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_hid_bias , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
       }
 
    if (error_id  ==  cudaSuccess) {
@@ -689,7 +1228,7 @@ int cuda_params_to_device (
          for (i=0 ; i<n_inputs ; i++)
             fdata[j*n_inputs_cols+i] = (float) w[j*n_inputs+i] ;
          }
-      error_id = cudaMemcpy ( h_w , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_w , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
       }
 
    if (error_id == cudaSuccess) {
@@ -697,7 +1236,7 @@ int cuda_params_to_device (
          for (j=0 ; j<nhid ; j++)
             fdata[i*nhid_cols+j] = (float) w[j*n_inputs+i] ;  // Transpose
          }
-      error_id = cudaMemcpy ( h_wtr , fdata , n_inputs * nhid_cols * sizeof(float) , cudaMemcpyHostToDevice ) ;
+      error_id = cudaMemcpy ( dev->h_wtr , fdata , n_inputs * nhid_cols * sizeof(float) , cudaMemcpyHostToDevice ) ;
       }
 
    if (error_id  !=  cudaSuccess) {
@@ -732,20 +1271,20 @@ int cuda_params_from_device (
 
    n_inputs_cols = (n_inputs + 31) / 32 * 32 ;
 
-   error_id = cudaMemcpy ( fdata , h_w , nhid * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+   error_id = cudaMemcpy ( fdata , dev->h_w , nhid * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
    for (ihid=0 ; ihid<nhid ; ihid++) {
       for (ivis=0 ; ivis<n_inputs ; ivis++)
          w[ihid*n_inputs+ivis] = fdata[ihid*n_inputs_cols+ivis] ;
       }
 
    if (error_id == cudaSuccess) {
-      error_id = cudaMemcpy ( fdata , h_in_bias , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_in_bias , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (ivis=0 ; ivis<n_inputs ; ivis++)
          in_bias[ivis] = fdata[ivis] ;
       }
 
    if (error_id == cudaSuccess) {
-      error_id = cudaMemcpy ( fdata , h_hid_bias , nhid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_hid_bias , nhid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (ihid=0 ; ihid<nhid ; ihid++)
          hid_bias[ihid] = fdata[ihid] ;
       }
@@ -816,8 +1355,9 @@ int cuda_recon_error (
       threads_per_block = 4 * warpsize ;
    blocks_per_grid = (n_inputs + threads_per_block - 1) / threads_per_block ;
 
-   device_recon_error <<< blocks_per_grid , threads_per_block >>> ( nc ) ;   
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "recon_error" ) ;
+   device_recon_error <<< blocks_per_grid , threads_per_block , 0 , dev->rbm_stream >>> ( nc ) ;   
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_recon_error launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -825,7 +1365,7 @@ int cuda_recon_error (
       return 1 ;
       }
 
-   error_id = cudaMemcpy ( fdata , h_err_vec , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+   error_id = cudaMemcpy ( fdata , dev->h_err_vec , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost ) ;
    for (i=0 ; i<n_inputs ; i++)
       err_vec[i] = fdata[i] ;
 
@@ -839,22 +1379,135 @@ int cuda_recon_error (
 }
 
 
+/*
+------------------------------------------------------------------------------------------------
+
+   Streaming the data from the host
+
+   When the dataset is too large for the device, each batch (or a device's
+   share of one) is gathered in shuffled order straight from the caller's
+   array into one of two pinned slots and copied down on copy_stream.
+   The caller names the next batch by rbm_cuda_stream_next(), and
+   cuda_rbm_batch stages it while the current graph runs, so the gather
+   and the copy overlap the computation.  A batch that was not prefetched
+   (the first of each epoch, and every batch in timing mode) is staged
+   when it is needed.
+
+   The two events per slot keep the gather from overwriting host memory
+   that is still being copied and the copy from overwriting device memory
+   that a batch is still reading.
+
+------------------------------------------------------------------------------------------------
+*/
+
+void rbm_cuda_stream_next (
+   int istart ,           // First case of the next batch, or -1 if unknown
+   int istop              // One past its last case
+   )
+{
+   stream_next_start = istart ;
+   stream_next_stop = istop ;
+}
+
+static int stream_stage (
+   int istart ,           // First case (position in the shuffled epoch) to stage
+   int istop              // One past last case
+   )
+{
+   int slot, icase, ivis ;
+   float *dst ;
+   double *src ;
+   char msg[256] ;
+   cudaError_t error_id ;
+
+   if (! dev->streaming)
+      return 0 ;
+
+   for (slot=0 ; slot<2 ; slot++) {
+      if (dev->stage_start[slot] == istart  &&  dev->stage_stop[slot] == istop)
+         return 0 ;       // Already staged or on its way
+      }
+
+   slot = dev->stage_next ;
+   dev->stage_next = 1 - slot ;
+   dev->stage_start[slot] = -1 ;
+
+   error_id = cudaEventSynchronize ( dev->stage_copied[slot] ) ;  // Prior upload is done with the host side
+
+   if (error_id == cudaSuccess) {
+      for (icase=istart ; icase<istop ; icase++) {
+         src = stream_data + (size_t) dev->shuffle_pinned[icase] * stream_ncols ;
+         dst = dev->stage_pinned[slot] + (size_t) (icase - istart) * stream_n_inputs ;
+         for (ivis=0 ; ivis<stream_n_inputs ; ivis++)
+            dst[ivis] = (float) src[ivis] ;
+         }
+      error_id = cudaStreamWaitEvent ( dev->copy_stream , dev->stage_used[slot] , 0 ) ;
+      }
+
+   if (error_id == cudaSuccess) {
+      PROF_CUDA_BEGIN ( "stage batch" , PROF_CAT_COPY , dev->copy_stream ) ;
+      error_id = cudaMemcpyAsync ( dev->stage[slot] , dev->stage_pinned[slot] ,
+                                   (size_t) (istop - istart) * stream_n_inputs * sizeof(float) ,
+                                   cudaMemcpyHostToDevice , dev->copy_stream ) ;
+      PROF_CUDA_END ( dev->copy_stream ) ;
+      PROF_COUNT ( PROF_BYTES_H2D , (size_t) (istop - istart) * stream_n_inputs * sizeof(float) ) ;
+      }
+   if (error_id == cudaSuccess)
+      error_id = cudaEventRecord ( dev->stage_copied[slot] , dev->copy_stream ) ;
+
+   if (error_id != cudaSuccess) {
+      sprintf_s ( msg , 255 , "stream_stage error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      return 1 ;
+      }
+
+   dev->stage_start[slot] = istart ;
+   dev->stage_stop[slot] = istop ;
+   return 0 ;
+}
+
+static int stream_wait (  // Make rbm_stream wait until the batch is on the device
+   int istart ,
+   int istop
+   )
+{
+   if (! dev->streaming)
+      return 0 ;
+
+   if (stream_stage ( istart , istop ))
+      return 1 ;
+
+   dev->stage_cur = (dev->stage_start[0] == istart  &&  dev->stage_stop[0] == istop)  ?  0 : 1 ;
+   return cudaStreamWaitEvent ( dev->rbm_stream , dev->stage_copied[dev->stage_cur] , 0 ) != cudaSuccess ;
+}
+
+static int stream_release ()  // Mark the work queued so far on rbm_stream as the slot's last reader
+{
+   if (! dev->streaming)
+      return 0 ;
+   return cudaEventRecord ( dev->stage_used[dev->stage_cur] , dev->rbm_stream ) != cudaSuccess ;
+}
+
+
 /*
 ------------------------------------------------------------------------------------------------
 
    cuda_fetch_vis1 saves in visible1 the actual input, shuffled and batch selected.
 
    If greedy_mean_field is false it then samples.
+   Random draws are indexed by the case's position in the epoch (istart+icase),
+   which is how RBM_THR2.CPP numbers them, so the host and device agree.
 
 ------------------------------------------------------------------------------------------------
 */
 
 __global__ void device_fetch_vis1 (
-   int istart ,        // First case in this batch
-   int random_offset   // Starting index in shuffle_index for random sampling
+   int istart ,           // First case in this batch
+   unsigned int rng_draw , // RNG_DRAW code for random sampling
+   float *batch           // If not NULL, the batch streamed from the host, already in shuffled order
    )
 {
-   int k, icase, ivis ;
+   int icase, ivis ;
    float frand ;
 
    ivis = blockIdx.x * blockDim.x + threadIdx.x ;
@@ -863,11 +1516,16 @@ __global__ void device_fetch_vis1 (
 
    icase = blockIdx.y ;
 
-   d_visible1[icase*d_n_inputs_cols+ivis] = d_data[d_shuffle_index[istart+icase]*d_n_inputs+ivis] ;
+   if (batch == NULL  &&  d_data_words)
+      d_visible1[icase*d_n_inputs_cols+ivis] =
+         ((d_data_bits[d_shuffle_index[istart+icase]*d_data_words+ivis/32] >> (ivis % 32)) & 1)  ?  1.0f : 0.0f ;
+   else if (batch == NULL)
+      d_visible1[icase*d_n_inputs_cols+ivis] = d_data[d_shuffle_index[istart+icase]*d_n_inputs+ivis] ;
+   else
+      d_visible1[icase*d_n_inputs_cols+ivis] = batch[icase*d_n_inputs+ivis] ;
 
    if (! d_greedy_mean_field) {
-      k = ((unsigned int) (icase * d_n_inputs + ivis + random_offset)) % d_ncases ;
-      frand = (float) d_shuffle_index[k] / (float) d_ncases ;
+      frand = rng_uniform ( d_rng_seed , rng_draw , istart+icase , ivis ) ;
       d_visible1[icase*d_n_inputs_cols+ivis] = (frand < d_visible1[icase*d_n_inputs_cols+ivis])  ?  1.0f : 0.0f ;
       }
 }
@@ -876,7 +1534,7 @@ int cuda_fetch_vis1 (
    int istart ,           // First case in this batch
    int istop ,            // One past last case
    int n_inputs ,         // Number of inputs
-   int random_offset ,    // Starting index in shuffle_index for random sampling
+   unsigned int rng_draw , // RNG_DRAW code for random sampling
    double *visible1       // If non-NULL, return n_inputs * (istop-istart) long
    )
 {
@@ -894,8 +1552,13 @@ int cuda_fetch_vis1 (
    block_launch.y = istop - istart ;
    block_launch.z = 1 ;
 
-   device_fetch_vis1 <<< block_launch , threads_per_block >>> ( istart , random_offset ) ;   
-   cudaThreadSynchronize() ;
+   if (! in_capture  &&  stream_wait ( istart , istop ))  // Else cuda_rbm_batch did it
+      return 1 ;
+
+   KERNEL_BEGIN ( "fetch_vis1" ) ;
+   device_fetch_vis1 <<< block_launch , threads_per_block , 0 , dev->rbm_stream >>>
+                     ( istart , rng_draw , dev->streaming  ?  dev->stage[dev->stage_cur] : NULL ) ;   
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_fetch_vis1 launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -903,9 +1566,12 @@ int cuda_fetch_vis1 (
       return 1 ;
       }
 
+   if (! in_capture  &&  stream_release ())
+      return 1 ;
+
    if (visible1 != NULL) {
       n_inputs_cols = (n_inputs + 31) / 32 * 32 ;
-      error_id = cudaMemcpy ( fdata , h_visible1 , (istop - istart) * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_visible1 , (istop - istart) * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (icase=0 ; icase<istop-istart ; icase++) {
          for (ivis=0 ; ivis<n_inputs ; ivis++)
             visible1[icase*n_inputs+ivis] = fdata[icase*n_inputs_cols+ivis] ;
@@ -926,57 +1592,135 @@ int cuda_fetch_vis1 (
 
    cuda_vis_to_hid uses visible1 to compute hidden1 probabilities
                    Also copies to hidden2 for later use in MC chain loop
+                   If requested, also samples them into hidden_act for the
+                   first step of the chain, saving a cuda_sample_hidden2 launch
+                   If the data are packed, visible1 is the batch's bits, and
+                   device_vis_to_hid_bits adds the w_tr rows of those that are on
 
 ------------------------------------------------------------------------------------------------
 */
 
 __global__ void device_vis_to_hid (
-   int nc                 // Number of cases in this batch
+   int nc ,               // Number of cases in this batch
+   int istart ,           // First case in this batch, for indexing random draws
+   unsigned int rng_draw , // RNG_DRAW code for sampling hidden_act
+   int sample             // Sample into hidden_act?
    )
 {
-   int icase, ivis, ihid ;
-   float sum, Q ;
+   int j, icase, ihid, row0, col0 ;
+   float acc[MM_PER_THREAD], Q, frand ;
 
-   ihid = blockIdx.x * blockDim.x + threadIdx.x ;
+   row0 = blockIdx.y * MM_TILE ;   // First case in this tile
+   col0 = blockIdx.x * MM_TILE ;   // First hidden neuron in this tile
+
+#if RBM_CUBLAS
+   mm_fetch ( d_hidden1 , d_nhid_cols , nc , d_nhid , row0 , col0 , acc ) ;
+#else
+   mm_tile ( 0 , d_visible1 , d_n_inputs_cols , d_wtr , d_nhid_cols ,
+             nc , d_nhid , d_n_inputs , row0 , col0 , acc ) ;
+#endif
+
+   ihid = col0 + threadIdx.x ;
+   if (ihid >= d_nhid)
+      return ;
+
+   for (j=0 ; j<MM_PER_THREAD ; j++) {
+      icase = row0 + threadIdx.y + j * MM_ROWS ;
+      if (icase >= nc)
+         break ;
+      Q = 1.0f / (1.0f + __expf(-(d_hid_bias[ihid] + acc[j]))) ;
+      d_hidden1[icase*d_nhid_cols+ihid] = Q ;
+      d_hidden2[icase*d_nhid_cols+ihid] = Q ;     // We'll need this for MC chain loop
+      d_hid_on_frac[icase*d_nhid_cols+ihid] = Q ;
+
+      if (sample) {
+         frand = rng_uniform ( d_rng_seed , rng_draw , istart+icase , ihid ) ;
+         d_hidden_act[icase*d_nhid_cols+ihid] = (frand < Q)  ?  1.0f : 0.0f ;
+         }
+      }
+}
+
+__global__ void device_vis_to_hid_bits (
+   int istart ,           // First case in this batch, for the shuffle and random draws
+   unsigned int rng_draw , // RNG_DRAW code for sampling hidden_act
+   int sample             // Sample into hidden_act?
+   )
+{
+   int icase, ihid, ivis, iword ;
+   unsigned int word, *bits ;
+   float sum, Q, frand ;
+
+   ihid = blockIdx.x * blockDim.x + threadIdx.x ;
    if (ihid >= d_nhid)
       return ;
 
    icase = blockIdx.y ;
 
-   sum = d_hid_bias[ihid] ;
-   for (ivis=0 ; ivis<d_n_inputs ; ivis++)
-      sum += d_wtr[ivis*d_nhid_cols+ihid] * d_visible1[icase*d_n_inputs_cols+ivis] ;
-   Q = 1.0f / (1.0f + __expf(-sum)) ;
+   sum = 0.0f ;
+   bits = d_data_bits + d_shuffle_index[istart+icase] * d_data_words ;
+   for (iword=0 ; iword<d_data_words ; iword++) {  // Every thread of the block walks the same bits
+      word = bits[iword] ;
+      while (word) {
+         ivis = iword * 32 + __ffs ( word ) - 1 ;
+         sum += d_wtr[ivis*d_nhid_cols+ihid] ;
+         word &= word - 1 ;
+         }
+      }
+
+   Q = 1.0f / (1.0f + __expf(-(d_hid_bias[ihid] + sum))) ;
    d_hidden1[icase*d_nhid_cols+ihid] = Q ;
    d_hidden2[icase*d_nhid_cols+ihid] = Q ;     // We'll need this for MC chain loop
    d_hid_on_frac[icase*d_nhid_cols+ihid] = Q ;
+
+   if (sample) {
+      frand = rng_uniform ( d_rng_seed , rng_draw , istart+icase , ihid ) ;
+      d_hidden_act[icase*d_nhid_cols+ihid] = (frand < Q)  ?  1.0f : 0.0f ;
+      }
 }
 
 int cuda_vis_to_hid (
    int nc ,                // Number of cases in this batch
    int nhid ,              // Number of hidden neurons
+   int istart ,            // First case in this batch, for indexing random draws
+   unsigned int rng_draw , // RNG_DRAW code for sampling hidden_act
+   int sample ,            // Sample into hidden_act?
    double *hidden1 ,       // Work vector nhid * (istop-istart) long
    double *hidden_act ,    // Work vector nhid * (istop-istart) long
    double *hid_on_frac     // Work vector nhid * (istop-istart) long
    )
 {
-   int icase, ihid, warpsize, threads_per_block, nhid_cols ;
+   int icase, ihid, nhid_cols, warpsize, threads_per_block ;
    char msg[256] ;
-   dim3 block_launch ;
+   dim3 grid_launch, block_launch ;
    cudaError_t error_id ;
 
-   warpsize = deviceProp.warpSize ;      // Threads per warp, likely 32 well into the future
+   if (dev->data_words) {
+      warpsize = deviceProp.warpSize ;
+      threads_per_block = (nhid + warpsize - 1) / warpsize * warpsize ;
+      if (threads_per_block > 4 * warpsize)
+         threads_per_block = 4 * warpsize ;
+      grid_launch.x = (nhid + threads_per_block - 1) / threads_per_block ;
+      grid_launch.y = nc ;
+      grid_launch.z = 1 ;
+      KERNEL_BEGIN ( "vis_to_hid" ) ;
+      device_vis_to_hid_bits <<< grid_launch , threads_per_block , 0 , dev->rbm_stream >>> ( istart , rng_draw , sample ) ;
+      KERNEL_END () ;
+      }
 
-   threads_per_block = (nhid + warpsize - 1) / warpsize * warpsize ;
-   if (threads_per_block > 4 * warpsize)
-      threads_per_block = 4 * warpsize ;
+   else {
+#if RBM_CUBLAS
+      if (mm_cublas ( "cuda_vis_to_hid" , 0 , nc , nhid , mm_n_inputs , 1.0f ,
+                      dev->h_visible1 , (mm_n_inputs + 31) / 32 * 32 , dev->h_wtr , (nhid + 31) / 32 * 32 ,
+                      0.0f , dev->h_hidden1 , (nhid + 31) / 32 * 32 ))
+         return 1 ;
+#endif
 
-   block_launch.x = (nhid + threads_per_block - 1) / threads_per_block ;
-   block_launch.y = nc ;
-   block_launch.z = 1 ;
+      mm_launch_dims ( nc , nhid , &grid_launch , &block_launch ) ;
 
-   device_vis_to_hid <<< block_launch , threads_per_block >>> ( nc ) ;   
-   cudaThreadSynchronize() ;
+      KERNEL_BEGIN ( "vis_to_hid" ) ;
+      device_vis_to_hid <<< grid_launch , block_launch , 0 , dev->rbm_stream >>> ( nc , istart , rng_draw , sample ) ;
+      KERNEL_END () ;
+      }
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_vis_to_hid launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -986,20 +1730,20 @@ int cuda_vis_to_hid (
 
    if (hidden1 != NULL) {
       nhid_cols = (nhid + 31) / 32 * 32 ;
-      error_id = cudaMemcpy ( fdata , h_hidden1 , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_hidden1 , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (icase=0 ; icase<nc ; icase++) {
          for (ihid=0 ; ihid<nhid ; ihid++)
             hidden1[icase*nhid+ihid] = fdata[icase*nhid_cols+ihid] ;
          }
       if (error_id == cudaSuccess) {
-         error_id = cudaMemcpy ( fdata , h_hidden_act , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+         error_id = cudaMemcpy ( fdata , dev->h_hidden_act , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
          for (icase=0 ; icase<nc ; icase++) {
             for (ihid=0 ; ihid<nhid ; ihid++)
                hidden_act[icase*nhid+ihid] = fdata[icase*nhid_cols+ihid] ;
             }
          }
       if (error_id == cudaSuccess) {
-         error_id = cudaMemcpy ( fdata , h_hid_on_frac , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+         error_id = cudaMemcpy ( fdata , dev->h_hid_on_frac , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
          for (icase=0 ; icase<nc ; icase++) {
             for (ihid=0 ; ihid<nhid ; ihid++)
                hid_on_frac[icase*nhid+ihid] = fdata[icase*nhid_cols+ihid] ;
@@ -1029,57 +1773,67 @@ int cuda_vis_to_hid (
 
 __global__ void device_hid_to_vis (
    int nc ,                // Number of cases in this batch
-   int random_offset       // Starting index in shuffle_index for random sampling
+   int istart ,            // First case in this batch, for indexing random draws
+   unsigned int rng_draw   // RNG_DRAW code for random sampling
    )
 {
-   int k, icase, ivis, ihid ;
-   float sum, P, frand ;
+   int j, icase, ivis, row0, col0 ;
+   float acc[MM_PER_THREAD], P, frand ;
 
-   ivis = blockIdx.x * blockDim.x + threadIdx.x ;
-   if (ivis >= d_n_inputs)
-      return ;
+   row0 = blockIdx.y * MM_TILE ;   // First case in this tile
+   col0 = blockIdx.x * MM_TILE ;   // First visible neuron in this tile
 
-   icase = blockIdx.y ;
+#if RBM_CUBLAS
+   mm_fetch ( d_visible2 , d_n_inputs_cols , nc , d_n_inputs , row0 , col0 , acc ) ;
+#else
+   mm_tile ( 0 , d_hidden_act , d_nhid_cols , d_w , d_n_inputs_cols ,
+             nc , d_n_inputs , d_nhid , row0 , col0 , acc ) ;
+#endif
 
-   sum = d_in_bias[ivis] ;
-   for (ihid=0 ; ihid<d_nhid ; ihid++)
-      sum += d_w[ihid*d_n_inputs_cols+ivis] * d_hidden_act[icase*d_nhid_cols+ihid] ;
-   P = 1.0f / (1.0f + __expf(-sum)) ;
+   ivis = col0 + threadIdx.x ;
+   if (ivis >= d_n_inputs)
+      return ;
 
-   if (d_mean_field)
-      d_visible2[icase*d_n_inputs_cols+ivis] = P ;
-   else {
-      k = ((unsigned int) (icase * d_n_inputs + ivis + random_offset)) % d_ncases ;
-      frand = (float) d_shuffle_index[k] / (float) d_ncases ;
-      d_visible2[icase*d_n_inputs_cols+ivis] = (frand < P)  ?  1.0f : 0.0f ;
+   for (j=0 ; j<MM_PER_THREAD ; j++) {
+      icase = row0 + threadIdx.y + j * MM_ROWS ;
+      if (icase >= nc)
+         break ;
+      P = 1.0f / (1.0f + __expf(-(d_in_bias[ivis] + acc[j]))) ;
+
+      if (d_mean_field)
+         d_visible2[icase*d_n_inputs_cols+ivis] = P ;
+      else {
+         frand = rng_uniform ( d_rng_seed , rng_draw , istart+icase , ivis ) ;
+         d_visible2[icase*d_n_inputs_cols+ivis] = (frand < P)  ?  1.0f : 0.0f ;
+         }
       }
-
 }
 
 int cuda_hid_to_vis (
    int nc ,                // Number of cases in this batch
    int n_inputs ,          // Number of inputs
-   int random_offset ,     // Starting index in shuffle_index for random sampling
+   int istart ,            // First case in this batch, for indexing random draws
+   unsigned int rng_draw , // RNG_DRAW code for random sampling
    double *visible2        // Work vector n_inputs * nc long
    )
 {
-   int icase, ivis, warpsize, threads_per_block, n_inputs_cols ;
+   int icase, ivis, n_inputs_cols ;
    char msg[256] ;
-   dim3 block_launch ;
+   dim3 grid_launch, block_launch ;
    cudaError_t error_id ;
 
-   warpsize = deviceProp.warpSize ;      // Threads per warp, likely 32 well into the future
-
-   threads_per_block = (n_inputs + warpsize - 1) / warpsize * warpsize ;
-   if (threads_per_block > 4 * warpsize)
-      threads_per_block = 4 * warpsize ;
+#if RBM_CUBLAS
+   if (mm_cublas ( "cuda_hid_to_vis" , 0 , nc , n_inputs , mm_nhid , 1.0f ,
+                   dev->h_hidden_act , (mm_nhid + 31) / 32 * 32 , dev->h_w , (n_inputs + 31) / 32 * 32 ,
+                   0.0f , dev->h_visible2 , (n_inputs + 31) / 32 * 32 ))
+      return 1 ;
+#endif
 
-   block_launch.x = (n_inputs + threads_per_block - 1) / threads_per_block ;
-   block_launch.y = nc ;
-   block_launch.z = 1 ;
+   mm_launch_dims ( nc , n_inputs , &grid_launch , &block_launch ) ;
 
-   device_hid_to_vis <<< block_launch , threads_per_block >>> ( nc , random_offset ) ;   
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "hid_to_vis" ) ;
+   device_hid_to_vis <<< grid_launch , block_launch , 0 , dev->rbm_stream >>> ( nc , istart , rng_draw ) ;   
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_hid_to_vis launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1089,7 +1843,7 @@ int cuda_hid_to_vis (
 
    if (visible2 != NULL) {
       n_inputs_cols = (n_inputs + 31) / 32 * 32 ;
-      error_id = cudaMemcpy ( fdata , h_visible2 , nc * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_visible2 , nc * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (icase=0 ; icase<nc ; icase++) {
          for (ivis=0 ; ivis<n_inputs ; ivis++)
             visible2[icase*n_inputs+ivis] = fdata[icase*n_inputs_cols+ivis] ;
@@ -1108,20 +1862,29 @@ __global__ void device_hid_to_vis_direct (
    int nc                 // Number of cases in this batch
    )
 {
-   int icase, ivis, ihid ;
-   float sum ;
+   int j, icase, ivis, row0, col0 ;
+   float acc[MM_PER_THREAD] ;
 
-   ivis = blockIdx.x * blockDim.x + threadIdx.x ;
-   if (ivis >= d_n_inputs)
-      return ;
+   row0 = blockIdx.y * MM_TILE ;
+   col0 = blockIdx.x * MM_TILE ;
 
-   icase = blockIdx.y ;
+#if RBM_CUBLAS
+   mm_fetch ( d_visible2 , d_n_inputs_cols , nc , d_n_inputs , row0 , col0 , acc ) ;
+#else
+   mm_tile ( 0 , d_hidden1 , d_nhid_cols , d_w , d_n_inputs_cols ,
+             nc , d_n_inputs , d_nhid , row0 , col0 , acc ) ;
+#endif
 
-   sum = d_in_bias[ivis] ;
-   for (ihid=0 ; ihid<d_nhid ; ihid++)
-      sum += d_w[ihid*d_n_inputs_cols+ivis] * d_hidden1[icase*d_nhid_cols+ihid] ;
-   d_visible2[icase*d_n_inputs_cols+ivis] = 1.0f / (1.0f + __expf(-sum)) ;
+   ivis = col0 + threadIdx.x ;
+   if (ivis >= d_n_inputs)
+      return ;
 
+   for (j=0 ; j<MM_PER_THREAD ; j++) {
+      icase = row0 + threadIdx.y + j * MM_ROWS ;
+      if (icase >= nc)
+         break ;
+      d_visible2[icase*d_n_inputs_cols+ivis] = 1.0f / (1.0f + __expf(-(d_in_bias[ivis] + acc[j]))) ;
+      }
 }
 
 int cuda_hid_to_vis_direct (
@@ -1129,23 +1892,22 @@ int cuda_hid_to_vis_direct (
    int n_inputs            // Number of inputs
    )
 {
-   int warpsize, threads_per_block ;
    char msg[256] ;
-   dim3 block_launch ;
+   dim3 grid_launch, block_launch ;
    cudaError_t error_id ;
 
-   warpsize = deviceProp.warpSize ;      // Threads per warp, likely 32 well into the future
-
-   threads_per_block = (n_inputs + warpsize - 1) / warpsize * warpsize ;
-   if (threads_per_block > 4 * warpsize)
-      threads_per_block = 4 * warpsize ;
+#if RBM_CUBLAS
+   if (mm_cublas ( "cuda_hid_to_vis_direct" , 0 , nc , n_inputs , mm_nhid , 1.0f ,
+                   dev->h_hidden1 , (mm_nhid + 31) / 32 * 32 , dev->h_w , (n_inputs + 31) / 32 * 32 ,
+                   0.0f , dev->h_visible2 , (n_inputs + 31) / 32 * 32 ))
+      return 1 ;
+#endif
 
-   block_launch.x = (n_inputs + threads_per_block - 1) / threads_per_block ;
-   block_launch.y = nc ;
-   block_launch.z = 1 ;
+   mm_launch_dims ( nc , n_inputs , &grid_launch , &block_launch ) ;
 
-   device_hid_to_vis_direct <<< block_launch , threads_per_block >>> ( nc ) ;   
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "hid_to_vis_direct" ) ;
+   device_hid_to_vis_direct <<< grid_launch , block_launch , 0 , dev->rbm_stream >>> ( nc ) ;   
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_hid_to_vis launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1161,49 +1923,76 @@ int cuda_hid_to_vis_direct (
 ------------------------------------------------------------------------------------------------
 
    cuda_vis2_to_hid2 uses visible2 to compute hidden2
+                     If requested, also samples it into hidden_act for the
+                     next step of the chain, replacing cuda_sample_hidden2
 
 ------------------------------------------------------------------------------------------------
 */
 
 __global__ void device_vis2_to_hid2 (
-   int nc         // Number of cases in this batch
+   int nc ,               // Number of cases in this batch
+   int istart ,           // First case in this batch, for indexing random draws
+   unsigned int rng_draw , // RNG_DRAW code for sampling hidden_act
+   int sample             // Sample into hidden_act?
    )
 {
-   int icase, ivis, ihid ;
-   float sum ;
+   int j, icase, ihid, row0, col0 ;
+   float acc[MM_PER_THREAD], Q, frand ;
 
-   ihid = blockIdx.x * blockDim.x + threadIdx.x ;
+   row0 = blockIdx.y * MM_TILE ;
+   col0 = blockIdx.x * MM_TILE ;
+
+#if RBM_CUBLAS
+   mm_fetch ( d_hidden2 , d_nhid_cols , nc , d_nhid , row0 , col0 , acc ) ;
+#else
+   mm_tile ( 0 , d_visible2 , d_n_inputs_cols , d_wtr , d_nhid_cols ,
+             nc , d_nhid , d_n_inputs , row0 , col0 , acc ) ;
+#endif
+
+   ihid = col0 + threadIdx.x ;
    if (ihid >= d_nhid)
       return ;
 
-   icase = blockIdx.y ;
+   for (j=0 ; j<MM_PER_THREAD ; j++) {
+      icase = row0 + threadIdx.y + j * MM_ROWS ;
+      if (icase >= nc)
+         break ;
+      Q = 1.0f / (1.0f + __expf(-(d_hid_bias[ihid] + acc[j]))) ;
+      d_hidden2[icase*d_nhid_cols+ihid] = Q ;
 
-   sum = d_hid_bias[ihid] ;
-   for (ivis=0 ; ivis<d_n_inputs ; ivis++)
-      sum += d_wtr[ivis*d_nhid_cols+ihid] * d_visible2[icase*d_n_inputs_cols+ivis] ;
-   d_hidden2[icase*d_nhid_cols+ihid] = 1.0f / (1.0f + __expf(-sum)) ;
+      if (sample) {
+         frand = rng_uniform ( d_rng_seed , rng_draw , istart+icase , ihid ) ;
+         d_hidden_act[icase*d_nhid_cols+ihid] = (frand < Q)  ?  1.0f : 0.0f ;
+         }
+      }
 }
 
 int cuda_vis2_to_hid2 (
    int nc ,                // Number of cases in this batch
    int nhid ,              // Number of hidden neurons
+   int istart ,            // First case in this batch, for indexing random draws
+   unsigned int rng_draw , // RNG_DRAW code for sampling hidden_act
+   int sample ,            // Sample into hidden_act?
    double *hidden2         // Work vector nhid * (istop-istart) long
    )
 {
-   int icase, ihid, warpsize, threads_per_block, nhid_cols ;
+   int icase, ihid, nhid_cols ;
    char msg[256] ;
-   dim3 block_launch ;
+   dim3 grid_launch, block_launch ;
    cudaError_t error_id ;
 
-   warpsize = deviceProp.warpSize ;      // Threads per warp, likely 32 well into the future
+#if RBM_CUBLAS
+   if (mm_cublas ( "cuda_vis2_to_hid2" , 0 , nc , nhid , mm_n_inputs , 1.0f ,
+                   dev->h_visible2 , (mm_n_inputs + 31) / 32 * 32 , dev->h_wtr , (nhid + 31) / 32 * 32 ,
+                   0.0f , dev->h_hidden2 , (nhid + 31) / 32 * 32 ))
+      return 1 ;
+#endif
 
-   threads_per_block = (nhid + warpsize - 1) / warpsize * warpsize ;
-   block_launch.x = (nhid + threads_per_block - 1) / threads_per_block ;
-   block_launch.y = nc ;
-   block_launch.z = 1 ;
+   mm_launch_dims ( nc , nhid , &grid_launch , &block_launch ) ;
 
-   device_vis2_to_hid2 <<< block_launch , threads_per_block >>> ( nc ) ;   
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "vis2_to_hid2" ) ;
+   device_vis2_to_hid2 <<< grid_launch , block_launch , 0 , dev->rbm_stream >>> ( nc , istart , rng_draw , sample ) ;   
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_vis_to_hid launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1213,7 +2002,7 @@ int cuda_vis2_to_hid2 (
 
    if (hidden2 != NULL) {
       nhid_cols = (nhid + 31) / 32 * 32 ;
-      error_id = cudaMemcpy ( fdata , h_hidden2 , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_hidden2 , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (icase=0 ; icase<nc ; icase++) {
          for (ihid=0 ; ihid<nhid ; ihid++)
             hidden2[icase*nhid+ihid] = fdata[icase*nhid_cols+ihid] ;
@@ -1239,10 +2028,11 @@ int cuda_vis2_to_hid2 (
 
 __global__ void device_sample_hidden2 (
    int nc ,                // Number of cases in this batch
-   int random_offset       // Starting index in shuffle_index for random sampling
+   int istart ,            // First case in this batch, for indexing random draws
+   unsigned int rng_draw   // RNG_DRAW code for random sampling
    )
 {
-   int k, icase, ihid ;
+   int icase, ihid ;
    float frand ;
 
    ihid = blockIdx.x * blockDim.x + threadIdx.x ;
@@ -1251,8 +2041,7 @@ __global__ void device_sample_hidden2 (
 
    icase = blockIdx.y ;
 
-   k = ((unsigned int) (icase * d_nhid + ihid + random_offset)) % d_ncases ;
-   frand = (float) d_shuffle_index[k] / (float) d_ncases ;
+   frand = rng_uniform ( d_rng_seed , rng_draw , istart+icase , ihid ) ;
 
    d_hidden_act[icase*d_nhid_cols+ihid] = (frand < d_hidden2[icase*d_nhid_cols+ihid])  ?  1.0f : 0.0f ;
 }
@@ -1260,7 +2049,8 @@ __global__ void device_sample_hidden2 (
 int cuda_sample_hidden2 (
    int nc ,                // Number of cases in this batch
    int nhid ,              // Number of hidden neurons
-   int random_offset ,     // Starting index in shuffle_index for random sampling
+   int istart ,            // First case in this batch, for indexing random draws
+   unsigned int rng_draw , // RNG_DRAW code for random sampling
    double *hidden_act      // Work vector nhid * (istop-istart) long
    )
 {
@@ -1276,8 +2066,9 @@ int cuda_sample_hidden2 (
    block_launch.y = nc ;
    block_launch.z = 1 ;
 
-   device_sample_hidden2 <<< block_launch , threads_per_block >>> ( nc , random_offset ) ;   
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "sample_hidden2" ) ;
+   device_sample_hidden2 <<< block_launch , threads_per_block , 0 , dev->rbm_stream >>> ( nc , istart , rng_draw ) ;   
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_sample_hidden2 launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1287,7 +2078,7 @@ int cuda_sample_hidden2 (
 
    if (hidden_act != NULL) {
       nhid_cols = (nhid + 31) / 32 * 32 ;
-      error_id = cudaMemcpy ( fdata , h_hidden_act , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_hidden_act , nc * nhid_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (icase=0 ; icase<nc ; icase++) {
          for (ihid=0 ; ihid<nhid ; ihid++)
             hidden_act[icase*nhid+ihid] = fdata[icase*nhid_cols+ihid] ;
@@ -1363,8 +2154,9 @@ int cuda_len_dot (
    if (blocks_per_grid > REDUC_BLOCKS)
       blocks_per_grid = REDUC_BLOCKS ;
 
-   device_len_dot <<< blocks_per_grid , REDUC_THREADS >>> () ;   
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "len_dot" ) ;
+   device_len_dot <<< blocks_per_grid , REDUC_THREADS , 0 , dev->rbm_stream >>> () ;   
+   KERNEL_END () ;
 
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
@@ -1373,14 +2165,14 @@ int cuda_len_dot (
       return 1 ;
       }
 
-   error_id = cudaMemcpy ( reduc_fdata , h_len_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+   error_id = cudaMemcpy ( reduc_fdata , dev->h_len_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
    sum = 0.0 ;
    for (i=0 ; i<blocks_per_grid ; i++)
       sum += reduc_fdata[i] ;
    *len = sum ;
 
    if (error_id == cudaSuccess) {
-      error_id = cudaMemcpy ( reduc_fdata , h_dot_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( reduc_fdata , dev->h_dot_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       sum = 0.0 ;
       for (i=0 ; i<blocks_per_grid ; i++)
          sum += reduc_fdata[i] ;
@@ -1462,8 +2254,9 @@ int cuda_max_inc_w (
    if (blocks_per_grid > REDUC_BLOCKS)
       blocks_per_grid = REDUC_BLOCKS ;
 
-   device_max_inc <<< blocks_per_grid , REDUC_THREADS >>> ( inc_vs_w ) ;   
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "max_inc" ) ;
+   device_max_inc <<< blocks_per_grid , REDUC_THREADS , 0 , dev->rbm_stream >>> ( inc_vs_w ) ;   
+   KERNEL_END () ;
 
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
@@ -1472,7 +2265,7 @@ int cuda_max_inc_w (
       return 1 ;
       }
 
-   error_id = cudaMemcpy ( reduc_fdata , h_len_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+   error_id = cudaMemcpy ( reduc_fdata , dev->h_len_out , blocks_per_grid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
    *max_inc_w = 0.0 ;
    for (i=0 ; i<blocks_per_grid ; i++) {
       if (reduc_fdata[i] > *max_inc_w)
@@ -1489,6 +2282,268 @@ int cuda_max_inc_w (
 }
 
 
+/*
+------------------------------------------------------------------------------------------------
+
+   cuda_snapshot_max_w - Queue the epoch-end max weight for the convergence test
+   cuda_snapshot_wait  - Wait for it and finish the reduction
+
+   This is cuda_max_inc_w(...,0) split in two so the host can finish its own
+   end-of-epoch bookkeeping while the reduction and copy run.
+
+------------------------------------------------------------------------------------------------
+*/
+
+int cuda_snapshot_max_w (
+   int n                // Number of weights; Not important; just heuristically sets # blocks
+   )
+{
+   char msg[256] ;
+   cudaError_t error_id ;
+
+   dev->snap_blocks = (n + REDUC_THREADS - 1) / REDUC_THREADS ;
+   if (dev->snap_blocks > REDUC_BLOCKS)
+      dev->snap_blocks = REDUC_BLOCKS ;
+
+   KERNEL_BEGIN ( "max_inc" ) ;
+   device_max_inc <<< dev->snap_blocks , REDUC_THREADS , 0 , dev->rbm_stream >>> ( 0 ) ;
+   KERNEL_END () ;
+   error_id = cudaGetLastError () ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyAsync ( dev->snap_out , dev->h_len_out , dev->snap_blocks * sizeof(float) ,
+                                   cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+   if (error_id == cudaSuccess)
+      error_id = cudaEventRecord ( dev->snap_event , dev->rbm_stream ) ;
+
+   if (error_id != cudaSuccess) {
+      sprintf_s ( msg , 255 , "cuda_snapshot_max_w error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      return 1 ;
+      }
+
+   return 0 ;
+}
+
+int cuda_snapshot_wait (
+   double *max_w        // Computed max absolute weight
+   )
+{
+   int i ;
+   char msg[256] ;
+   cudaError_t error_id ;
+
+   error_id = cudaEventSynchronize ( dev->snap_event ) ;
+   if (error_id != cudaSuccess) {
+      sprintf_s ( msg , 255 , "cuda_snapshot_wait error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      return 1 ;
+      }
+
+   *max_w = 0.0 ;
+   for (i=0 ; i<dev->snap_blocks ; i++) {
+      if (dev->snap_out[i] > *max_w)
+         *max_w = dev->snap_out[i] ;
+      }
+
+   return 0 ;
+}
+
+
+/*
+------------------------------------------------------------------------------------------------
+
+   cuda_snapshot_state      - Queue a copy of the training state for a checkpoint
+   cuda_snapshot_state_wait - Wait for it and unpad it into the caller's arrays
+   cuda_state_to_device     - Restore the part of it rbm_cuda_init() does not send
+
+   The state is everything the batches carry forward: the weights and
+   biases, their increments, the smoothed hidden on fractions, and the
+   prior gradient for the learning-rate dot product.  All devices hold the
+   same values, so the snapshot is of device 0 and the restore goes to all.
+   The copies are queued on rbm_stream behind the batch just finished, and
+   as each batch synchronizes that stream, they have arrived by the end of
+   the next one; rbm_cuda() does not wait for them until then.
+   The weights and the restored transpose are padded to n_inputs_cols.
+
+------------------------------------------------------------------------------------------------
+*/
+
+int cuda_snapshot_state (
+   int n_inputs ,          // Number of inputs
+   int nhid                // Number of hidden neurons
+   )
+{
+   int n_inputs_cols ;
+   size_t nw ;
+   float *fptr ;
+   char msg[256] ;
+   cudaError_t error_id ;
+
+   n_inputs_cols = (n_inputs + 31) / 32 * 32 ;
+   nw = (size_t) n_inputs_cols * nhid ;
+
+   error_id = cudaSuccess ;
+   if (dev->state_pinned == NULL) {
+      error_id = cudaMallocHost ( (void **) &dev->state_pinned , (3 * nw + 2 * n_inputs + 3 * nhid) * sizeof(float) ) ;
+      if (error_id == cudaSuccess)
+         error_id = cudaEventCreateWithFlags ( &dev->state_event , cudaEventDisableTiming ) ;
+      }
+
+   fptr = dev->state_pinned ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyAsync ( fptr , dev->h_w , nw * sizeof(float) , cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+   fptr += nw ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyAsync ( fptr , dev->h_w_inc , nw * sizeof(float) , cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+   fptr += nw ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyAsync ( fptr , dev->h_prev_grad , nw * sizeof(float) , cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+   fptr += nw ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyAsync ( fptr , dev->h_in_bias , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+   fptr += n_inputs ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyAsync ( fptr , dev->h_in_bias_inc , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+   fptr += n_inputs ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyAsync ( fptr , dev->h_hid_bias , nhid * sizeof(float) , cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+   fptr += nhid ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyAsync ( fptr , dev->h_hid_bias_inc , nhid * sizeof(float) , cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+   fptr += nhid ;
+   if (error_id == cudaSuccess)
+      error_id = cudaMemcpyAsync ( fptr , dev->h_hid_on_smoothed , nhid * sizeof(float) , cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+   if (error_id == cudaSuccess)
+      error_id = cudaEventRecord ( dev->state_event , dev->rbm_stream ) ;
+
+   if (error_id != cudaSuccess) {
+      sprintf_s ( msg , 255 , "cuda_snapshot_state error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      return 1 ;
+      }
+
+   PROF_COUNT ( PROF_BYTES_D2H , (3 * nw + 2 * n_inputs + 3 * nhid) * sizeof(float) ) ;
+   return 0 ;
+}
+
+int cuda_snapshot_state_wait (
+   int n_inputs ,          // Number of inputs
+   int nhid ,              // Number of hidden neurons
+   double *w ,             // Returned, each nhid sets of n_inputs
+   double *w_inc ,
+   double *prev_grad ,
+   double *in_bias ,       // Returned, each n_inputs long
+   double *in_bias_inc ,
+   double *hid_bias ,      // Returned, each nhid long
+   double *hid_bias_inc ,
+   double *hid_on_smoothed
+   )
+{
+   int i, ihid, ivis, n_inputs_cols ;
+   size_t nw ;
+   float *fptr ;
+   char msg[256] ;
+   cudaError_t error_id ;
+
+   error_id = cudaEventSynchronize ( dev->state_event ) ;
+   if (error_id != cudaSuccess) {
+      sprintf_s ( msg , 255 , "cuda_snapshot_state_wait error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      return 1 ;
+      }
+
+   n_inputs_cols = (n_inputs + 31) / 32 * 32 ;
+   nw = (size_t) n_inputs_cols * nhid ;
+
+   fptr = dev->state_pinned ;
+   for (ihid=0 ; ihid<nhid ; ihid++) {
+      for (ivis=0 ; ivis<n_inputs ; ivis++) {
+         w[ihid*n_inputs+ivis] = fptr[ihid*n_inputs_cols+ivis] ;
+         w_inc[ihid*n_inputs+ivis] = fptr[nw+ihid*n_inputs_cols+ivis] ;
+         prev_grad[ihid*n_inputs+ivis] = fptr[2*nw+ihid*n_inputs_cols+ivis] ;
+         }
+      }
+   fptr += 3 * nw ;
+
+   for (i=0 ; i<n_inputs ; i++) {
+      in_bias[i] = fptr[i] ;
+      in_bias_inc[i] = fptr[n_inputs+i] ;
+      }
+   fptr += 2 * n_inputs ;
+
+   for (i=0 ; i<nhid ; i++) {
+      hid_bias[i] = fptr[i] ;
+      hid_bias_inc[i] = fptr[nhid+i] ;
+      hid_on_smoothed[i] = fptr[2*nhid+i] ;
+      }
+
+   return 0 ;
+}
+
+int cuda_state_to_device (
+   int n_inputs ,          // Number of inputs
+   int nhid ,              // Number of hidden neurons
+   double *w_inc ,         // Nhid sets of n_inputs
+   double *prev_grad ,     // Ditto
+   double *in_bias_inc ,   // N_inputs long
+   double *hid_bias_inc ,  // Nhid long
+   double *hid_on_smoothed // Ditto
+   )
+{
+   int i, idev, ihid, ivis, n_inputs_cols ;
+   char msg[256] ;
+   cudaError_t error_id ;
+
+   n_inputs_cols = (n_inputs + 31) / 32 * 32 ;
+
+   error_id = cudaSuccess ;
+   for (idev=0 ; idev<n_devices  &&  error_id == cudaSuccess ; idev++) {
+      rbm_cuda_select ( idev ) ;
+
+      for (ihid=0 ; ihid<nhid ; ihid++) {
+         for (ivis=0 ; ivis<n_inputs_cols ; ivis++)
+            fdata[ihid*n_inputs_cols+ivis] = (ivis < n_inputs)  ?  (float) w_inc[ihid*n_inputs+ivis] : 0.0f ;
+         }
+      error_id = cudaMemcpy ( dev->h_w_inc , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+
+      if (error_id == cudaSuccess) {
+         for (ihid=0 ; ihid<nhid ; ihid++) {
+            for (ivis=0 ; ivis<n_inputs_cols ; ivis++)
+               fdata[ihid*n_inputs_cols+ivis] = (ivis < n_inputs)  ?  (float) prev_grad[ihid*n_inputs+ivis] : 0.0f ;
+            }
+         error_id = cudaMemcpy ( dev->h_prev_grad , fdata , n_inputs_cols * nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+         }
+
+      if (error_id == cudaSuccess) {
+         for (i=0 ; i<n_inputs ; i++)
+            fdata[i] = (float) in_bias_inc[i] ;
+         error_id = cudaMemcpy ( dev->h_in_bias_inc , fdata , n_inputs * sizeof(float) , cudaMemcpyHostToDevice ) ;
+         }
+
+      if (error_id == cudaSuccess) {
+         for (i=0 ; i<nhid ; i++)
+            fdata[i] = (float) hid_bias_inc[i] ;
+         error_id = cudaMemcpy ( dev->h_hid_bias_inc , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+         }
+
+      if (error_id == cudaSuccess) {
+         for (i=0 ; i<nhid ; i++)
+            fdata[i] = (float) hid_on_smoothed[i] ;
+         error_id = cudaMemcpy ( dev->h_hid_on_smoothed , fdata , nhid * sizeof(float) , cudaMemcpyHostToDevice ) ;
+         }
+      }
+   rbm_cuda_select ( 0 ) ;
+
+   if (error_id != cudaSuccess) {
+      sprintf_s ( msg , 255 , "CUDA bad state_to_device %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      return ERROR_CUDA_ERROR ;
+      }
+
+   return 0 ;
+}
+
+
 /*
 ------------------------------------------------------------------------------------------------
 
@@ -1498,23 +2553,34 @@ int cuda_max_inc_w (
 */
 
 __global__ void device_update_in_bias (
-   int nc ,               // Number of cases in this batch
+   int nc ,               // Number of cases in this batch; this device's share if RBM_UPDATE_SUM
    float rate ,           // Learning rate
-   float momentum         // Learning momentum
+   float momentum ,       // Learning momentum
+   int phase              // RBM_UPDATE_ALL, _SUM, or _APPLY
    )
 {
    int icase, ivis ;
-   float sum ;
+   float sum, *sum_ptr ;
 
    ivis = blockIdx.x * blockDim.x + threadIdx.x ;
 
    if (ivis >= d_n_inputs)
       return ;
 
-   sum = 0.0f ;
+   sum_ptr = d_sums + d_n_inputs_cols * d_nhid + ivis ;   // After the weights; see cuda_rbm_batch_multi
 
-   for (icase=0 ; icase<nc ; icase++)
-      sum += d_visible1[icase*d_n_inputs_cols+ivis] - d_visible2[icase*d_n_inputs_cols+ivis] ;
+   if (phase == RBM_UPDATE_APPLY)
+      sum = *sum_ptr ;
+   else {
+      sum = 0.0f ;
+      for (icase=0 ; icase<nc ; icase++)
+         sum += d_visible1[icase*d_n_inputs_cols+ivis] - d_visible2[icase*d_n_inputs_cols+ivis] ;
+      }
+
+   if (phase == RBM_UPDATE_SUM) {
+      *sum_ptr = sum ;
+      return ;
+      }
 
    d_in_bias_inc[ivis] = momentum * d_in_bias_inc[ivis] + rate * sum / nc ;
    d_in_bias[ivis] += d_in_bias_inc[ivis] ;
@@ -1541,8 +2607,9 @@ int cuda_update_in_bias (
       threads_per_block = 4 * warpsize ;
    blocks_per_grid = (n_inputs + threads_per_block - 1) / threads_per_block ;
 
-   device_update_in_bias <<< blocks_per_grid , threads_per_block >>> ( nc , (float) rate , (float) momentum ) ;   
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "update_in_bias" ) ;
+   device_update_in_bias <<< blocks_per_grid , threads_per_block , 0 , dev->rbm_stream >>> ( nc , (float) rate , (float) momentum , update_phase ) ;   
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_update_in_bias launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1551,11 +2618,11 @@ int cuda_update_in_bias (
       }
 
    if (in_bias != NULL  &&  error_id == cudaSuccess) {
-      error_id = cudaMemcpy ( fdata , h_in_bias , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_in_bias , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (i=0 ; i<n_inputs ; i++)
          in_bias[i] = fdata[i] ;
       if (error_id == cudaSuccess) {
-         error_id = cudaMemcpy ( fdata , h_in_bias_inc , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+         error_id = cudaMemcpy ( fdata , dev->h_in_bias_inc , n_inputs * sizeof(float) , cudaMemcpyDeviceToHost ) ;
          for (i=0 ; i<n_inputs ; i++)
             in_bias_inc[i] = fdata[i] ;
          }
@@ -1583,21 +2650,29 @@ __global__ void device_update_hid_bias (
    int nc ,               // Number of cases in this batch
    float rate ,           // Learning rate
    float momentum ,       // Learning momentum
-   int random_offset ,    // Starting index in shuffle_index for random sampling hidden1 if not mean_field
+   int istart ,           // First case in this batch, for indexing random draws
+   unsigned int rng_draw , // RNG_DRAW code for random sampling hidden1 if not mean_field
    float sparse_pen ,     // Sparsity penalty
-   float sparse_targ      // Sparsity target
+   float sparse_targ ,    // Sparsity target
+   int phase              // RBM_UPDATE_ALL, _SUM, or _APPLY
    )
 {
-   int icase, ihid, k ;
-   float sum, frac_on, frand ;
+   int icase, ihid ;
+   float sum, frac_on, frand, *sum_ptr ;
 
    ihid = blockIdx.x * blockDim.x + threadIdx.x ;
 
    if (ihid >= d_nhid)
       return ;
 
+   sum_ptr = d_sums + d_n_inputs_cols * d_nhid + d_n_inputs + ihid ;  // Then frac_on nhid later
+
    sum = frac_on = 0.0f ;
-   if (d_mean_field) {
+   if (phase == RBM_UPDATE_APPLY) {
+      sum = sum_ptr[0] ;
+      frac_on = sum_ptr[d_nhid] ;
+      }
+   else if (d_mean_field) {
       for (icase=0 ; icase<nc ; icase++) {
          sum += d_hidden1[icase*d_nhid_cols+ihid] - d_hidden2[icase*d_nhid_cols+ihid] ;
          frac_on += d_hid_on_frac[icase*d_nhid_cols+ihid] ;
@@ -1605,14 +2680,19 @@ __global__ void device_update_hid_bias (
       }
    else {
       for (icase=0 ; icase<nc ; icase++) {
-         k = ((unsigned int) (icase * d_nhid + ihid + random_offset)) % d_ncases ;
-         frand = (float) d_shuffle_index[k] / (float) d_ncases ;
+         frand = rng_uniform ( d_rng_seed , rng_draw , istart+icase , ihid ) ;
          d_hidden_act[icase*d_nhid_cols+ihid] = (frand < d_hidden1[icase*d_nhid_cols+ihid])  ?  1.0f : 0.0f ;
          sum += d_hidden_act[icase*d_nhid_cols+ihid] - d_hidden2[icase*d_nhid_cols+ihid] ;
          frac_on += d_hid_on_frac[icase*d_nhid_cols+ihid] ;
          }
       }
 
+   if (phase == RBM_UPDATE_SUM) {
+      sum_ptr[0] = sum ;
+      sum_ptr[d_nhid] = frac_on ;
+      return ;
+      }
+
    sum /= nc ;
    frac_on /= nc ;
    d_hid_on_smoothed[ihid] = 0.95f * d_hid_on_smoothed[ihid] + 0.05f * frac_on ;
@@ -1632,7 +2712,8 @@ int cuda_update_hid_bias (
    int nhid ,              // Number of hidden neurons
    double rate ,           // Learning rate
    double momentum ,       // Learning momentum
-   int random_offset ,     // Starting index in shuffle_index for random sampling hidden1 if not mean_field
+   int istart ,            // First case in this batch, for indexing random draws
+   unsigned int rng_draw , // RNG_DRAW code for random sampling hidden1 if not mean_field
    double sparse_pen ,     // Sparsity penalty
    double sparse_targ ,    // Sparsity target
    double *hid_bias ,      // Hidden bias vector, nhid long
@@ -1650,10 +2731,11 @@ int cuda_update_hid_bias (
       threads_per_block = 4 * warpsize ;
    blocks_per_grid = (nhid + threads_per_block - 1) / threads_per_block ;
 
-   device_update_hid_bias <<< blocks_per_grid , threads_per_block >>>
-              ( nc , (float) rate , (float) momentum , random_offset ,
-              (float) sparse_pen , (float) sparse_targ ) ;   
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "update_hid_bias" ) ;
+   device_update_hid_bias <<< blocks_per_grid , threads_per_block , 0 , dev->rbm_stream >>>
+              ( nc , (float) rate , (float) momentum , istart , rng_draw ,
+              (float) sparse_pen , (float) sparse_targ , update_phase ) ;   
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_update_in_bias launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1662,11 +2744,11 @@ int cuda_update_hid_bias (
       }
 
    if (hid_bias != NULL) {
-      error_id = cudaMemcpy ( fdata , h_hid_bias , nhid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_hid_bias , nhid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (i=0 ; i<nhid ; i++)
          hid_bias[i] = fdata[i] ;
       if (error_id == cudaSuccess) {
-         error_id = cudaMemcpy ( fdata , h_hid_bias_inc , nhid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+         error_id = cudaMemcpy ( fdata , dev->h_hid_bias_inc , nhid * sizeof(float) , cudaMemcpyDeviceToHost ) ;
          for (i=0 ; i<nhid ; i++)
             hid_bias_inc[i] = fdata[i] ;
          }
@@ -1686,6 +2768,9 @@ int cuda_update_hid_bias (
 
    cuda_update_weights
 
+   This also writes the transposed weights, so cuda_transpose is not needed
+   after it.
+
 ------------------------------------------------------------------------------------------------
 */
 
@@ -1695,40 +2780,61 @@ __global__ void device_update_weights (
    float momentum ,       // Learning momentum
    float weight_pen ,     // Weight penalty
    float sparse_pen ,     // Sparsity penalty
-   float sparse_targ      // Sparsity target
+   float sparse_targ ,    // Sparsity target
+   int phase              // RBM_UPDATE_ALL, _SUM (not with RBM_CUBLAS), or _APPLY
    )
 {
-   int icase, ivis, ihid ;
-   float sum ;
+   int j, ivis, ihid, row0, col0 ;
+   float pos[MM_PER_THREAD], sum ;
+#if ! RBM_CUBLAS
+   float neg[MM_PER_THREAD] ;
+#endif
 
-   ivis = blockIdx.x * blockDim.x + threadIdx.x ;
-   if (ivis >= d_n_inputs)
-      return ;
+   row0 = blockIdx.y * MM_TILE ;   // First hidden neuron in this tile
+   col0 = blockIdx.x * MM_TILE ;   // First visible neuron in this tile
 
-   ihid = blockIdx.y ;
+   // The gradient is hidden' * visible over the batch, positive phase minus negative
 
-   sum = 0.0f ;
-   if (d_mean_field) {
-      for (icase=0 ; icase<nc ; icase++)
-         sum +=  d_hidden1[icase*d_nhid_cols+ihid] * d_visible1[icase*d_n_inputs_cols+ivis] -
-                 d_hidden2[icase*d_nhid_cols+ihid] * d_visible2[icase*d_n_inputs_cols+ivis] ;
-      }
+   if (phase == RBM_UPDATE_APPLY)
+      mm_fetch ( d_sums , d_n_inputs_cols , d_nhid , d_n_inputs , row0 , col0 , pos ) ;
    else {
-      for (icase=0 ; icase<nc ; icase++)
-         sum +=  d_hidden_act[icase*d_nhid_cols+ihid] * d_visible1[icase*d_n_inputs_cols+ivis] -
-                 d_hidden2[icase*d_nhid_cols+ihid] * d_visible2[icase*d_n_inputs_cols+ivis] ;
+#if RBM_CUBLAS
+      mm_fetch ( d_w_grad , d_n_inputs_cols , d_nhid , d_n_inputs , row0 , col0 , pos ) ;
+#else
+      mm_tile ( 1 , d_mean_field ? d_hidden1 : d_hidden_act , d_nhid_cols , d_visible1 , d_n_inputs_cols ,
+                d_nhid , d_n_inputs , nc , row0 , col0 , pos ) ;
+      mm_tile ( 1 , d_hidden2 , d_nhid_cols , d_visible2 , d_n_inputs_cols ,
+                d_nhid , d_n_inputs , nc , row0 , col0 , neg ) ;
+      for (j=0 ; j<MM_PER_THREAD ; j++)
+         pos[j] -= neg[j] ;
+#endif
       }
-   sum /= nc ;
-   sum -= weight_pen * d_w[ihid*d_n_inputs_cols+ivis] ;
-   sum -= d_data_mean[ivis] * sparse_pen * (d_hid_on_smoothed[ihid] - sparse_targ) ;
-   if (d_hid_on_smoothed[ihid] < 0.01)
-      sum -= d_data_mean[ivis] * 0.5 * (d_hid_on_smoothed[ihid] - 0.01) ;       // 0.5 is heuristic
-   if (d_hid_on_smoothed[ihid] > 0.99)
-      sum -= d_data_mean[ivis] * 0.5 * (d_hid_on_smoothed[ihid] - 0.99) ;
 
-   d_w_grad[ihid*d_n_inputs_cols+ivis] = sum ;
-   d_w_inc[ihid*d_n_inputs_cols+ivis] = momentum * d_w_inc[ihid*d_n_inputs_cols+ivis] + rate * sum ;
-   d_w[ihid*d_n_inputs_cols+ivis] += d_w_inc[ihid*d_n_inputs_cols+ivis] ;
+   ivis = col0 + threadIdx.x ;
+   if (ivis >= d_n_inputs)
+      return ;
+
+   for (j=0 ; j<MM_PER_THREAD ; j++) {
+      ihid = row0 + threadIdx.y + j * MM_ROWS ;
+      if (ihid >= d_nhid)
+         break ;
+      if (phase == RBM_UPDATE_SUM) {
+         d_sums[ihid*d_n_inputs_cols+ivis] = pos[j] ;
+         continue ;
+         }
+      sum = pos[j] / nc ;
+      sum -= weight_pen * d_w[ihid*d_n_inputs_cols+ivis] ;
+      sum -= d_data_mean[ivis] * sparse_pen * (d_hid_on_smoothed[ihid] - sparse_targ) ;
+      if (d_hid_on_smoothed[ihid] < 0.01)
+         sum -= d_data_mean[ivis] * 0.5 * (d_hid_on_smoothed[ihid] - 0.01) ;       // 0.5 is heuristic
+      if (d_hid_on_smoothed[ihid] > 0.99)
+         sum -= d_data_mean[ivis] * 0.5 * (d_hid_on_smoothed[ihid] - 0.99) ;
+
+      d_w_grad[ihid*d_n_inputs_cols+ivis] = sum ;
+      d_w_inc[ihid*d_n_inputs_cols+ivis] = momentum * d_w_inc[ihid*d_n_inputs_cols+ivis] + rate * sum ;
+      d_w[ihid*d_n_inputs_cols+ivis] += d_w_inc[ihid*d_n_inputs_cols+ivis] ;
+      d_wtr[ivis*d_nhid_cols+ihid] = d_w[ihid*d_n_inputs_cols+ivis] ;
+      }
 }
 
 
@@ -1746,26 +2852,43 @@ int cuda_update_weights (
    double *w_grad          // We'll need grad for auto update of rate; nhid * n_inputs
    )
 {
-   int ivis, ihid, warpsize, threads_per_block ;
-   int n_inputs_cols ;
+   int ivis, ihid ;
+   int n_inputs_cols, nhid_cols ;
    char msg[256] ;
-   dim3 block_launch ;
+   dim3 grid_launch, block_launch ;
    cudaError_t error_id ;
+#if RBM_CUBLAS
+   float *wg ;
+#endif
 
-   warpsize = deviceProp.warpSize ; // Threads per warp, likely 32 well into the future
+   n_inputs_cols = (n_inputs + 31) / 32 * 32 ;
+   nhid_cols = (nhid + 31) / 32 * 32 ;
 
-   threads_per_block = (n_inputs + warpsize - 1) / warpsize * warpsize ;
-   if (threads_per_block > 4 * warpsize)
-      threads_per_block = 4 * warpsize ;
+#if RBM_CUBLAS
+   // w_grad = hidden' * visible1 - hidden2' * visible2; the kernel finishes it.
+   // For RBM_UPDATE_SUM the raw product is all that is wanted, so it goes to sums.
+   if (update_phase != RBM_UPDATE_APPLY) {
+      wg = (update_phase == RBM_UPDATE_SUM)  ?  dev->h_sums : dev->h_w_grad ;
+      if (mm_cublas ( "cuda_update_weights" , 1 , nhid , n_inputs , nc , 1.0f ,
+                      mm_mean_field ? dev->h_hidden1 : dev->h_hidden_act , nhid_cols , dev->h_visible1 , n_inputs_cols ,
+                      0.0f , wg , n_inputs_cols ))
+         return 1 ;
+      if (mm_cublas ( "cuda_update_weights" , 1 , nhid , n_inputs , nc , -1.0f ,
+                      dev->h_hidden2 , nhid_cols , dev->h_visible2 , n_inputs_cols ,
+                      1.0f , wg , n_inputs_cols ))
+         return 1 ;
+      if (update_phase == RBM_UPDATE_SUM)
+         return 0 ;
+      }
+#endif
 
-   block_launch.x = (n_inputs + threads_per_block - 1) / threads_per_block ;
-   block_launch.y = nhid ;
-   block_launch.z = 1 ;
+   mm_launch_dims ( nhid , n_inputs , &grid_launch , &block_launch ) ;
 
-   device_update_weights <<< block_launch , threads_per_block >>>
+   KERNEL_BEGIN ( "update_weights" ) ;
+   device_update_weights <<< grid_launch , block_launch , 0 , dev->rbm_stream >>>
               ( nc , (float) rate , (float) momentum , (float) weight_pen ,
-              (float) sparse_pen , (float) sparse_targ ) ;   
-   cudaThreadSynchronize() ;
+              (float) sparse_pen , (float) sparse_targ , update_phase ) ;   
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_update_weights launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1774,21 +2897,20 @@ int cuda_update_weights (
       }
 
    if (w != NULL) {
-      n_inputs_cols = (n_inputs + 31) / 32 * 32 ;
-      error_id = cudaMemcpy ( fdata , h_w , nhid * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+      error_id = cudaMemcpy ( fdata , dev->h_w , nhid * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
       for (ihid=0 ; ihid<nhid ; ihid++) {
          for (ivis=0 ; ivis<n_inputs ; ivis++)
             w[ihid*n_inputs+ivis] = fdata[ihid*n_inputs_cols+ivis] ;
          }
       if (error_id == cudaSuccess) {
-         error_id = cudaMemcpy ( fdata , h_w_inc , nhid * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+         error_id = cudaMemcpy ( fdata , dev->h_w_inc , nhid * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
          for (ihid=0 ; ihid<nhid ; ihid++) {
             for (ivis=0 ; ivis<n_inputs ; ivis++)
                w_inc[ihid*n_inputs+ivis] = fdata[ihid*n_inputs_cols+ivis] ;
             }
          }
       if (error_id == cudaSuccess) {
-         error_id = cudaMemcpy ( fdata , h_w_grad , nhid * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
+         error_id = cudaMemcpy ( fdata , dev->h_w_grad , nhid * n_inputs_cols * sizeof(float) , cudaMemcpyDeviceToHost ) ;
          for (ihid=0 ; ihid<nhid ; ihid++) {
             for (ivis=0 ; ivis<n_inputs ; ivis++)
                w_grad[ihid*n_inputs+ivis] = fdata[ihid*n_inputs_cols+ivis] ;
@@ -1844,8 +2966,9 @@ int cuda_transpose (
    block_launch.y = nhid ;
    block_launch.z = 1 ;
 
-   device_transpose <<< block_launch , threads_per_block >>> () ;
-   cudaThreadSynchronize() ;
+   KERNEL_BEGIN ( "transpose" ) ;
+   device_transpose <<< block_launch , threads_per_block , 0 , dev->rbm_stream >>> () ;
+   KERNEL_END () ;
    error_id = cudaGetLastError () ;
    if (error_id != cudaSuccess) {
       sprintf_s ( msg , 255 , "cuda_transpose launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
@@ -1858,108 +2981,725 @@ int cuda_transpose (
 
 
 /*
---------------------------------------------------------------------------------
+------------------------------------------------------------------------------------------------
 
-   RBM_CUDA_CLEANUP - Cleanup after CUDA RBM processing
+   device_batch_sums - Finish a batch's reductions in one block
 
---------------------------------------------------------------------------------
+   The recon_error vector and the REDUC_BLOCKS partials of max_inc and
+   len_dot are reduced to the scalars of h_batch_sums, so a batch copies
+   RBM_N_BATCH_SUMS floats back to the host rather than all of them.
+   Max_inc and len_dot share d_len_out, so which selects the one to finish
+   and this is launched after each.
+
+------------------------------------------------------------------------------------------------
 */
 
-void rbm_cuda_cleanup ()
+__global__ void device_batch_sums (
+   int n_blocks ,         // Number of partials in d_len_out and d_dot_out
+   int which              // RBM_SUM_ERR, RBM_SUM_MAX, or RBM_SUM_LEN (which also does RBM_SUM_DOT)
+   )
 {
-   char msg[256] ;
+   __shared__ float partial_a[REDUC_THREADS], partial_b[REDUC_THREADS] ;
+   int i, index ;
+   float sum_a, sum_b ;
 
-   sprintf_s ( msg, 255, "CUDA rbm_cuda_cleanup" ) ;
-   MEMTEXT ( msg ) ;
-   if (h_data != NULL) {
-      cudaFree ( h_data ) ;
-      h_data = NULL ;
-      }
-   if (h_data_mean != NULL) {
-      cudaFree ( h_data_mean ) ;
-      h_data_mean = NULL ;
-      }
-   if (h_in_bias != NULL) {
-      cudaFree ( h_in_bias ) ;
-      h_in_bias = NULL ;
+   index = threadIdx.x ;
+
+   sum_a = sum_b = 0.0f ;
+   if (which == RBM_SUM_ERR) {
+      for (i=index ; i<d_n_inputs ; i+=blockDim.x)
+         sum_a += d_err_vec[i] ;
       }
-   if (h_hid_bias != NULL) {
-      cudaFree ( h_hid_bias ) ;
-      h_hid_bias = NULL ;
+   else if (which == RBM_SUM_MAX) {
+      for (i=index ; i<n_blocks ; i+=blockDim.x) {
+         if (d_len_out[i] > sum_a)
+            sum_a = d_len_out[i] ;
+         }
       }
-   if (h_w != NULL) {
-      cudaFree ( h_w ) ;
-      h_w = NULL ;
+   else {
+      for (i=index ; i<n_blocks ; i+=blockDim.x) {
+         sum_a += d_len_out[i] ;
+         sum_b += d_dot_out[i] ;
+         }
       }
-   if (h_wtr != NULL) {
-      cudaFree ( h_wtr ) ;
-      h_wtr = NULL ;
+
+   partial_a[index] = sum_a ;
+   partial_b[index] = sum_b ;
+   __syncthreads() ;
+
+   for (i=blockDim.x>>1 ; i ; i>>=1) {
+      if (index < i) {
+         if (which == RBM_SUM_MAX) {
+            if (partial_a[index+i] > partial_a[index])
+               partial_a[index] = partial_a[index+i] ;
+            }
+         else {
+            partial_a[index] += partial_a[index+i] ;
+            partial_b[index] += partial_b[index+i] ;
+            }
+         }
+      __syncthreads() ;
       }
-   if (h_shuffle_index != NULL) {
-      cudaFree ( h_shuffle_index ) ;
-      h_shuffle_index = NULL ;
+
+   if (index == 0) {
+      d_batch_sums[which] = partial_a[0] ;
+      if (which == RBM_SUM_LEN)
+         d_batch_sums[RBM_SUM_DOT] = partial_b[0] ;
       }
-   if (h_visible1 != NULL) {
-      cudaFree ( h_visible1 ) ;
-      h_visible1 = NULL ;
+}
+
+
+/*
+------------------------------------------------------------------------------------------------
+
+   queue_chain - Queue the sampling part of a batch on the current device:
+                 the input, the Markov chain, and the reconstruction error,
+                 which is left summed in h_batch_sums.
+
+------------------------------------------------------------------------------------------------
+*/
+
+static int queue_chain (
+   int istart ,            // First case in this batch (or share of one)
+   int istop ,             // One past last case
+   int n_inputs ,          // Number of inputs
+   int nhid ,              // Number of hidden neurons
+   int n_chain ,           // Length of Markov chain
+   int i_epoch             // Epoch, for numbering random draws
+   )
+{
+   int nc, ichain, warpsize, threads_per_block, blocks_per_grid, ret_val ;
+
+   nc = istop - istart ;
+
+   ret_val = cuda_fetch_vis1 ( istart , istop , n_inputs , RNG_DRAW ( i_epoch , 0 , RNG_VIS1 ) , NULL ) ;
+
+   if (! ret_val)
+      ret_val = cuda_vis_to_hid ( nc , nhid , istart , RNG_DRAW ( i_epoch , 0 , RNG_HID_ACT ) ,
+                                  n_chain > 0 , NULL , NULL , NULL ) ;
+
+   for (ichain=0 ; ichain<n_chain  &&  ! ret_val ; ichain++) {
+      ret_val = cuda_hid_to_vis ( nc , n_inputs , istart , RNG_DRAW ( i_epoch , ichain , RNG_VIS2 ) , NULL ) ;
+
+      if (ichain == 0  &&  ! ret_val) {
+         warpsize = deviceProp.warpSize ;
+         threads_per_block = (n_inputs + warpsize - 1) / warpsize * warpsize ;
+         if (threads_per_block > 4 * warpsize)
+            threads_per_block = 4 * warpsize ;
+         blocks_per_grid = (n_inputs + threads_per_block - 1) / threads_per_block ;
+         KERNEL_BEGIN ( "recon_error" ) ;
+         device_recon_error <<< blocks_per_grid , threads_per_block , 0 , dev->rbm_stream >>> ( nc ) ;
+         KERNEL_END () ;
+         KERNEL_BEGIN ( "batch_sums" ) ;
+         device_batch_sums <<< 1 , REDUC_THREADS , 0 , dev->rbm_stream >>> ( 0 , RBM_SUM_ERR ) ;
+         KERNEL_END () ;
+         }
+
+      if (! ret_val)
+         ret_val = cuda_vis2_to_hid2 ( nc , nhid , istart , RNG_DRAW ( i_epoch , ichain+1 , RNG_HID_ACT ) ,
+                                       ichain+1 < n_chain , NULL ) ;
       }
-   if (h_visible2 != NULL) {
-      cudaFree ( h_visible2 ) ;
-      h_visible2 = NULL ;
+
+   return ret_val ;
+}
+
+
+/*
+------------------------------------------------------------------------------------------------
+
+   cuda_rbm_batch_multi - cuda_rbm_batch for several devices
+
+   Each device takes a contiguous share of the batch.  Random draws are
+   indexed by the case's position in the epoch, so the samples are the ones
+   a single device would draw.  The update kernels first leave each device's
+   raw sums in d_sums (RBM_UPDATE_SUM).  These are laid out as the weight
+   gradient (n_inputs_cols by nhid), then the input bias sums, the hidden
+   bias sums, and the hidden on fractions.
+
+   Device 0 adds the other devices' sums to its own in device order, which
+   makes the total repeatable, and copies it back to every device.  All of
+   them then apply the same update to the same parameters (RBM_UPDATE_APPLY),
+   so they stay identical without any further exchange, and the max increment
+   and gradient length and dot product are taken from device 0 alone.
+
+   The launches are issued directly on each device's stream rather than
+   captured; a graph would save little next to the peer copies.
+
+------------------------------------------------------------------------------------------------
+*/
+
+__global__ void device_add_sums (
+   int n ,                // Length of d_sums
+   float *src             // Another device's sums, already copied to this device
+   )
+{
+   int i ;
+
+   for (i=blockIdx.x*blockDim.x+threadIdx.x ; i<n ; i+=blockDim.x*gridDim.x)
+      d_sums[i] += src[i] ;
+}
+
+static void split_shares (
+   int istart ,            // First case in the batch
+   int istop ,             // One past last case
+   int *share_start ,      // Returns each device's share, n_devices long
+   int *share_stop
+   )
+{
+   int idev, n_done, n_share ;
+
+   n_done = 0 ;
+   for (idev=0 ; idev<n_devices ; idev++) {
+      n_share = (istop - istart - n_done) / (n_devices - idev) ;   // Cases left / devices left
+      share_start[idev] = istart + n_done ;
+      share_stop[idev] = istart + n_done + n_share ;
+      n_done += n_share ;
       }
-   if (h_hidden1 != NULL) {
-      cudaFree ( h_hidden1 ) ;
-      h_hidden1 = NULL ;
+}
+
+static int cuda_rbm_batch_multi (
+   int istart ,            // First case in this batch
+   int istop ,             // One past last case
+   int n_inputs ,          // Number of inputs
+   int nhid ,              // Number of hidden neurons
+   int n_chain ,           // Length of Markov chain
+   int i_epoch ,           // Epoch, for numbering random draws
+   double rate ,           // Learning rate
+   double momentum ,       // Learning momentum
+   double weight_pen ,     // Weight penalty
+   double sparse_pen ,     // Sparsity penalty
+   double sparse_targ ,    // Sparsity target
+   double *error ,         // Returns reconstruction error summed over this batch
+   double *max_inc ,       // Returns max absolute weight increment
+   double *len ,           // Returns squared length of the weight gradient
+   double *dot             // Returns dot product of the gradient with the previous one
+   )
+{
+   int idev, nc, n_share, reduc_blocks, ret_val ;
+   int share_start[RBM_MAX_GPUS], share_stop[RBM_MAX_GPUS] ;
+   double sum ;
+   char msg[256] ;
+   cudaError_t error_id ;
+
+   nc = istop - istart ;
+
+   reduc_blocks = (n_inputs * nhid + REDUC_THREADS - 1) / REDUC_THREADS ;
+   if (reduc_blocks > REDUC_BLOCKS)
+      reduc_blocks = REDUC_BLOCKS ;
+
+   split_shares ( istart , istop , share_start , share_stop ) ;
+
+/*
+   Every device runs the chain on its share and computes its raw sums
+*/
+
+   ret_val = 0 ;
+   error_id = cudaSuccess ;
+   update_phase = RBM_UPDATE_SUM ;
+
+   for (idev=0 ; idev<n_devices  &&  ! ret_val ; idev++) {
+      rbm_cuda_select ( idev ) ;
+      n_share = share_stop[idev] - share_start[idev] ;
+      ret_val = queue_chain ( share_start[idev] , share_stop[idev] , n_inputs , nhid ,
+                              n_chain , i_epoch ) ;
+      if (! ret_val  &&  idev > 0)   // Device 0 brings back all of its sums at the end
+         cudaMemcpyAsync ( dev->batch_out , dev->h_batch_sums , sizeof(float) , cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+      if (! ret_val)
+         ret_val = cuda_update_in_bias ( n_share , n_inputs , rate , momentum , NULL , NULL ) ;
+      if (! ret_val)
+         ret_val = cuda_update_hid_bias ( n_share , nhid , rate , momentum , share_start[idev] ,
+                                          RNG_DRAW ( i_epoch , 0 , RNG_HID1 ) , sparse_pen , sparse_targ , NULL , NULL ) ;
+      if (! ret_val)
+         ret_val = cuda_update_weights ( n_share , n_inputs , nhid , rate , momentum , weight_pen ,
+                                         sparse_pen , sparse_targ , NULL , NULL , NULL ) ;
+      if (! ret_val)
+         error_id = cudaEventRecord ( dev->sum_event , dev->rbm_stream ) ;
+      if (error_id != cudaSuccess)
+         ret_val = 1 ;
       }
-   if (h_hidden2 != NULL) {
-      cudaFree ( h_hidden2 ) ;
-      h_hidden2 = NULL ;
+
+/*
+   All-reduce: gather into device 0 in device order, then broadcast the total
+*/
+
+   if (! ret_val) {
+      rbm_cuda_select ( 0 ) ;
+      for (idev=1 ; idev<n_devices  &&  error_id == cudaSuccess ; idev++) {
+         error_id = cudaStreamWaitEvent ( dev->rbm_stream , devices[idev].sum_event , 0 ) ;
+         if (error_id == cudaSuccess)
+            error_id = cudaMemcpyPeerAsync ( dev->h_peer , 0 , devices[idev].h_sums , idev ,
+                                             n_sums * sizeof(float) , dev->rbm_stream ) ;
+         if (error_id == cudaSuccess) {
+            KERNEL_BEGIN ( "add_sums" ) ;
+            device_add_sums <<< REDUC_BLOCKS , REDUC_THREADS , 0 , dev->rbm_stream >>> ( n_sums , dev->h_peer ) ;
+            KERNEL_END () ;
+            error_id = cudaGetLastError () ;
+            }
+         }
+      if (error_id == cudaSuccess)
+         error_id = cudaEventRecord ( dev->sum_event , dev->rbm_stream ) ;
+
+      for (idev=1 ; idev<n_devices  &&  error_id == cudaSuccess ; idev++) {
+         rbm_cuda_select ( idev ) ;
+         error_id = cudaStreamWaitEvent ( dev->rbm_stream , devices[0].sum_event , 0 ) ;
+         if (error_id == cudaSuccess)
+            error_id = cudaMemcpyPeerAsync ( dev->h_sums , idev , devices[0].h_sums , 0 ,
+                                             n_sums * sizeof(float) , dev->rbm_stream ) ;
+         }
+
+      if (error_id != cudaSuccess) {
+         sprintf_s ( msg , 255 , "cuda_rbm_batch_multi all-reduce error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+         audit ( msg ) ;
+         ret_val = 1 ;
+         }
       }
-   if (h_hidden_act != NULL) {
-      cudaFree ( h_hidden_act ) ;
-      h_hidden_act = NULL ;
+
+/*
+   Every device applies the total to its copy of the parameters
+*/
+
+   update_phase = RBM_UPDATE_APPLY ;
+
+   for (idev=0 ; idev<n_devices  &&  ! ret_val ; idev++) {
+      rbm_cuda_select ( idev ) ;
+      ret_val = cuda_update_in_bias ( nc , n_inputs , rate , momentum , NULL , NULL ) ;
+      if (! ret_val)
+         ret_val = cuda_update_hid_bias ( nc , nhid , rate , momentum , istart ,
+                                          RNG_DRAW ( i_epoch , 0 , RNG_HID1 ) , sparse_pen , sparse_targ , NULL , NULL ) ;
+      if (! ret_val)
+         ret_val = cuda_update_weights ( nc , n_inputs , nhid , rate , momentum , weight_pen ,
+                                         sparse_pen , sparse_targ , NULL , NULL , NULL ) ;
+      }
+
+   update_phase = RBM_UPDATE_ALL ;
+   rbm_cuda_select ( 0 ) ;
+
+   if (! ret_val) {   // Max_inc borrows len_out, so finish it before len_dot overwrites it
+      KERNEL_BEGIN ( "max_inc" ) ;
+      device_max_inc <<< reduc_blocks , REDUC_THREADS , 0 , dev->rbm_stream >>> ( 1 ) ;
+      KERNEL_END () ;
+      KERNEL_BEGIN ( "batch_sums" ) ;
+      device_batch_sums <<< 1 , REDUC_THREADS , 0 , dev->rbm_stream >>> ( reduc_blocks , RBM_SUM_MAX ) ;
+      KERNEL_END () ;
+      KERNEL_BEGIN ( "len_dot" ) ;
+      device_len_dot <<< reduc_blocks , REDUC_THREADS , 0 , dev->rbm_stream >>> () ;
+      KERNEL_END () ;
+      KERNEL_BEGIN ( "batch_sums" ) ;
+      device_batch_sums <<< 1 , REDUC_THREADS , 0 , dev->rbm_stream >>> ( reduc_blocks , RBM_SUM_LEN ) ;
+      KERNEL_END () ;
+      cudaMemcpyAsync ( dev->batch_out , dev->h_batch_sums , RBM_N_BATCH_SUMS * sizeof(float) ,
+                        cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+      error_id = cudaGetLastError () ;
+      }
+
+   if (! ret_val  &&  error_id == cudaSuccess  &&  stream_next_start >= 0  &&  devices[0].streaming) {
+      split_shares ( stream_next_start , stream_next_stop , share_start , share_stop ) ;
+      for (idev=0 ; idev<n_devices  &&  ! ret_val ; idev++) {   // Next shares come down meanwhile
+         rbm_cuda_select ( idev ) ;
+         ret_val = stream_stage ( share_start[idev] , share_stop[idev] ) ;
+         }
       }
-   if (h_in_bias_inc != NULL) {
-      cudaFree ( h_in_bias_inc ) ;
-      h_in_bias_inc = NULL ;
+
+   for (idev=n_devices-1 ; idev>=0  &&  ! ret_val ; idev--) {  // Ends on device 0
+      rbm_cuda_select ( idev ) ;
+      if (error_id == cudaSuccess)
+         error_id = cudaStreamSynchronize ( dev->rbm_stream ) ;
       }
-   if (h_hid_bias_inc != NULL) {
-      cudaFree ( h_hid_bias_inc ) ;
-      h_hid_bias_inc = NULL ;
+
+   if (ret_val  ||  error_id != cudaSuccess) {
+      rbm_cuda_select ( 0 ) ;
+      sprintf_s ( msg , 255 , "cuda_rbm_batch_multi error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      return 1 ;
       }
-   if (h_hid_on_frac != NULL) {
-      cudaFree ( h_hid_on_frac ) ;
-      h_hid_on_frac = NULL ;
+
+/*
+   Pool the results.  The error is summed over devices, in order.
+*/
+
+   sum = 0.0 ;
+   if (n_chain > 0) {        // Else there was no reconstruction
+      for (idev=0 ; idev<n_devices ; idev++)
+         sum += devices[idev].batch_out[RBM_SUM_ERR] ;
       }
-   if (h_hid_on_smoothed != NULL) {
-      cudaFree ( h_hid_on_smoothed ) ;
-      h_hid_on_smoothed = NULL ;
+   *error = sum ;
+
+   *max_inc = dev->batch_out[RBM_SUM_MAX] ;
+   *len = dev->batch_out[RBM_SUM_LEN] ;
+   *dot = dev->batch_out[RBM_SUM_DOT] ;
+
+   return 0 ;
+}
+
+
+/*
+------------------------------------------------------------------------------------------------
+
+   cuda_rbm_batch - Do the complete CD-k step for one batch as a single graph launch
+
+   The launches are captured on rbm_stream without any host synchronization,
+   including the Markov chain and the reductions that rbm_cuda() needs after
+   each batch (error, max increment, and the gradient length and dot product).
+   Device_batch_sums finishes them there, and the few scalars reach pinned
+   memory by one async copy inside the graph, so the host waits only once
+   per batch.
+
+   Kernel arguments change every batch, so the launches are captured again
+   each time and the previous executable graph is updated in place.
+   Only a change in its shape (chain length) forces a new instantiation.
+
+   The random draws are the same ones that rbm_cuda() uses in timing mode.
+   With more than one device, cuda_rbm_batch_multi() does the work instead.
+
+------------------------------------------------------------------------------------------------
+*/
+
+int cuda_rbm_batch (
+   int istart ,            // First case in this batch
+   int istop ,             // One past last case
+   int n_inputs ,          // Number of inputs
+   int nhid ,              // Number of hidden neurons
+   int n_chain ,           // Length of Markov chain
+   int i_epoch ,           // Epoch, for numbering random draws
+   double rate ,           // Learning rate
+   double momentum ,       // Learning momentum
+   double weight_pen ,     // Weight penalty
+   double sparse_pen ,     // Sparsity penalty
+   double sparse_targ ,    // Sparsity target
+   double *error ,         // Returns reconstruction error summed over this batch
+   double *max_inc ,       // Returns max absolute weight increment
+   double *len ,           // Returns squared length of the weight gradient
+   double *dot             // Returns dot product of the gradient with the previous one
+   )
+{
+   int nc, reduc_blocks, ret_val ;
+   char msg[256] ;
+   cudaError_t error_id ;
+   cudaGraph_t graph ;
+
+   if (n_devices > 1)
+      return cuda_rbm_batch_multi ( istart , istop , n_inputs , nhid , n_chain , i_epoch , rate , momentum ,
+                                    weight_pen , sparse_pen , sparse_targ , error , max_inc , len , dot ) ;
+
+   nc = istop - istart ;
+
+   reduc_blocks = (n_inputs * nhid + REDUC_THREADS - 1) / REDUC_THREADS ;
+   if (reduc_blocks > REDUC_BLOCKS)
+      reduc_blocks = REDUC_BLOCKS ;
+
+   if (stream_wait ( istart , istop ))   // Outside the capture, since the copy is on another stream
+      return 1 ;
+
+   error_id = cudaStreamBeginCapture ( dev->rbm_stream , cudaStreamCaptureModeThreadLocal ) ;
+   if (error_id != cudaSuccess) {
+      sprintf_s ( msg , 255 , "cuda_rbm_batch BeginCapture error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      return 1 ;
       }
-   if (h_w_inc != NULL) {
-      cudaFree ( h_w_inc ) ;
-      h_w_inc = NULL ;
+   in_capture = 1 ;
+
+/*
+   Capture the batch.  The wrappers only launch here because every
+   host pointer passed to them is NULL.
+*/
+
+   ret_val = queue_chain ( istart , istop , n_inputs , nhid , n_chain , i_epoch ) ;
+
+   if (! ret_val)
+      ret_val = cuda_update_in_bias ( nc , n_inputs , rate , momentum , NULL , NULL ) ;
+   if (! ret_val)
+      ret_val = cuda_update_hid_bias ( nc , nhid , rate , momentum , istart , RNG_DRAW ( i_epoch , 0 , RNG_HID1 ) ,
+                                       sparse_pen , sparse_targ , NULL , NULL ) ;
+   if (! ret_val)
+      ret_val = cuda_update_weights ( nc , n_inputs , nhid , rate , momentum , weight_pen ,
+                                      sparse_pen , sparse_targ , NULL , NULL , NULL ) ;
+
+   if (! ret_val) {   // Max_inc borrows len_out, so finish it before len_dot overwrites it
+      KERNEL_BEGIN ( "max_inc" ) ;
+      device_max_inc <<< reduc_blocks , REDUC_THREADS , 0 , dev->rbm_stream >>> ( 1 ) ;
+      KERNEL_END () ;
+      KERNEL_BEGIN ( "batch_sums" ) ;
+      device_batch_sums <<< 1 , REDUC_THREADS , 0 , dev->rbm_stream >>> ( reduc_blocks , RBM_SUM_MAX ) ;
+      KERNEL_END () ;
+      KERNEL_BEGIN ( "len_dot" ) ;
+      device_len_dot <<< reduc_blocks , REDUC_THREADS , 0 , dev->rbm_stream >>> () ;
+      KERNEL_END () ;
+      KERNEL_BEGIN ( "batch_sums" ) ;
+      device_batch_sums <<< 1 , REDUC_THREADS , 0 , dev->rbm_stream >>> ( reduc_blocks , RBM_SUM_LEN ) ;
+      KERNEL_END () ;
+      cudaMemcpyAsync ( dev->batch_out , dev->h_batch_sums , RBM_N_BATCH_SUMS * sizeof(float) ,
+                        cudaMemcpyDeviceToHost , dev->rbm_stream ) ;
+      }
+
+   graph = NULL ;
+   error_id = cudaStreamEndCapture ( dev->rbm_stream , &graph ) ;   // Always end it, even after an error
+   in_capture = 0 ;
+   if (ret_val  ||  error_id != cudaSuccess) {
+      if (graph != NULL)
+         cudaGraphDestroy ( graph ) ;
+      sprintf_s ( msg , 255 , "cuda_rbm_batch capture error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      return 1 ;
       }
-   if (h_w_grad != NULL) {
-      cudaFree ( h_w_grad ) ;
-      h_w_grad = NULL ;
+
+/*
+   Update the executable graph if its shape is unchanged, else make a new one
+*/
+
+   if (dev->batch_exec != NULL) {
+#if CUDART_VERSION >= 12000
+      cudaGraphExecUpdateResultInfo update_info ;
+      error_id = cudaGraphExecUpdate ( dev->batch_exec , graph , &update_info ) ;
+#else
+      cudaGraphNode_t error_node ;
+      cudaGraphExecUpdateResult update_result ;
+      error_id = cudaGraphExecUpdate ( dev->batch_exec , graph , &error_node , &update_result ) ;
+#endif
+      if (error_id != cudaSuccess) {
+         cudaGetLastError () ;      // Clear the update failure; it is expected
+         cudaGraphExecDestroy ( dev->batch_exec ) ;
+         dev->batch_exec = NULL ;
+         }
       }
-   if (h_prev_grad != NULL) {
-      cudaFree ( h_prev_grad ) ;
-      h_prev_grad = NULL ;
+
+   error_id = cudaSuccess ;
+   if (dev->batch_exec == NULL)
+      error_id = cudaGraphInstantiateWithFlags ( &dev->batch_exec , graph , 0 ) ;
+   cudaGraphDestroy ( graph ) ;
+
+   if (error_id == cudaSuccess) {
+      PROF_CUDA_BEGIN ( "rbm batch graph" , PROF_CAT_KERNEL , dev->rbm_stream ) ;
+      error_id = cudaGraphLaunch ( dev->batch_exec , dev->rbm_stream ) ;
+      PROF_CUDA_END ( dev->rbm_stream ) ;
       }
-   if (h_err_vec != NULL) {
-      cudaFree ( h_err_vec ) ;
-      h_err_vec = NULL ;
+
+   if (error_id == cudaSuccess  &&  dev->streaming) {  // Bring down the next batch while this one runs
+      ret_val = stream_release () ;
+      if (! ret_val  &&  stream_next_start >= 0)
+         ret_val = stream_stage ( stream_next_start , stream_next_stop ) ;
+      if (ret_val)
+         error_id = cudaErrorUnknown ;
       }
-   if (h_len_out != NULL) {
-      cudaFree ( h_len_out ) ;
-      h_len_out = NULL ;
+
+   if (error_id == cudaSuccess)
+      error_id = cudaStreamSynchronize ( dev->rbm_stream ) ;
+   if (error_id != cudaSuccess) {
+      sprintf_s ( msg , 255 , "cuda_rbm_batch graph launch error %d: %s", error_id, cudaGetErrorString(error_id) ) ;
+      audit ( msg ) ;
+      if (dev->batch_exec != NULL) {
+         cudaGraphExecDestroy ( dev->batch_exec ) ;
+         dev->batch_exec = NULL ;
+         }
+      return 1 ;
       }
-   if (h_dot_out != NULL) {
-      cudaFree ( h_dot_out ) ;
-      h_dot_out = NULL ;
+
+/*
+   Return the results, already pooled on the device
+*/
+
+   *error = (n_chain > 0)  ?  dev->batch_out[RBM_SUM_ERR] : 0.0 ;  // Else there was no reconstruction
+   *max_inc = dev->batch_out[RBM_SUM_MAX] ;
+   *len = dev->batch_out[RBM_SUM_LEN] ;
+   *dot = dev->batch_out[RBM_SUM_DOT] ;
+
+   return 0 ;
+}
+
+
+/*
+--------------------------------------------------------------------------------
+
+   RBM_CUDA_CLEANUP - Cleanup after CUDA RBM processing
+
+--------------------------------------------------------------------------------
+*/
+
+void rbm_cuda_cleanup ()
+{
+   int i, idev ;
+   char msg[256] ;
+
+   sprintf_s ( msg, 255, "CUDA rbm_cuda_cleanup" ) ;
+   MEMTEXT ( msg ) ;
+   for (idev=0 ; idev<n_devices ; idev++) {
+      rbm_cuda_select ( idev ) ;
+      if (dev->h_data != NULL) {
+         cudaFree ( dev->h_data ) ;
+         dev->h_data = NULL ;
+         }
+      if (dev->h_data_bits != NULL) {
+         cudaFree ( dev->h_data_bits ) ;
+         dev->h_data_bits = NULL ;
+         }
+      if (dev->streaming) {
+         cudaStreamSynchronize ( dev->copy_stream ) ;
+         for (i=0 ; i<2 ; i++) {
+            if (dev->stage_pinned[i] != NULL)
+               cudaFreeHost ( dev->stage_pinned[i] ) ;
+            if (dev->stage[i] != NULL)
+               cudaFree ( dev->stage[i] ) ;
+            if (dev->stage_copied[i] != NULL)
+               cudaEventDestroy ( dev->stage_copied[i] ) ;
+            if (dev->stage_used[i] != NULL)
+               cudaEventDestroy ( dev->stage_used[i] ) ;
+            dev->stage_pinned[i] = dev->stage[i] = NULL ;
+            }
+         if (dev->copy_stream != NULL)
+            cudaStreamDestroy ( dev->copy_stream ) ;
+         dev->copy_stream = NULL ;
+         dev->streaming = 0 ;
+         }
+      if (dev->h_data_mean != NULL) {
+         cudaFree ( dev->h_data_mean ) ;
+         dev->h_data_mean = NULL ;
+         }
+      if (dev->h_in_bias != NULL) {
+         cudaFree ( dev->h_in_bias ) ;
+         dev->h_in_bias = NULL ;
+         }
+      if (dev->h_hid_bias != NULL) {
+         cudaFree ( dev->h_hid_bias ) ;
+         dev->h_hid_bias = NULL ;
+         }
+      if (dev->h_w != NULL) {
+         cudaFree ( dev->h_w ) ;
+         dev->h_w = NULL ;
+         }
+      if (dev->h_wtr != NULL) {
+         cudaFree ( dev->h_wtr ) ;
+         dev->h_wtr = NULL ;
+         }
+      if (dev->h_shuffle_index != NULL) {
+         cudaFree ( dev->h_shuffle_index ) ;
+         dev->h_shuffle_index = NULL ;
+         }
+      if (dev->h_visible1 != NULL) {
+         cudaFree ( dev->h_visible1 ) ;
+         dev->h_visible1 = NULL ;
+         }
+      if (dev->h_visible2 != NULL) {
+         cudaFree ( dev->h_visible2 ) ;
+         dev->h_visible2 = NULL ;
+         }
+      if (dev->h_hidden1 != NULL) {
+         cudaFree ( dev->h_hidden1 ) ;
+         dev->h_hidden1 = NULL ;
+         }
+      if (dev->h_hidden2 != NULL) {
+         cudaFree ( dev->h_hidden2 ) ;
+         dev->h_hidden2 = NULL ;
+         }
+      if (dev->h_hidden_act != NULL) {
+         cudaFree ( dev->h_hidden_act ) ;
+         dev->h_hidden_act = NULL ;
+         }
+      if (dev->h_in_bias_inc != NULL) {
+         cudaFree ( dev->h_in_bias_inc ) ;
+         dev->h_in_bias_inc = NULL ;
+         }
+      if (dev->h_hid_bias_inc != NULL) {
+         cudaFree ( dev->h_hid_bias_inc ) ;
+         dev->h_hid_bias_inc = NULL ;
+         }
+      if (dev->h_hid_on_frac != NULL) {
+         cudaFree ( dev->h_hid_on_frac ) ;
+         dev->h_hid_on_frac = NULL ;
+         }
+      if (dev->h_hid_on_smoothed != NULL) {
+         cudaFree ( dev->h_hid_on_smoothed ) ;
+         dev->h_hid_on_smoothed = NULL ;
+         }
+      if (dev->h_w_inc != NULL) {
+         cudaFree ( dev->h_w_inc ) ;
+         dev->h_w_inc = NULL ;
+         }
+      if (dev->h_w_grad != NULL) {
+         cudaFree ( dev->h_w_grad ) ;
+         dev->h_w_grad = NULL ;
+         }
+      if (dev->h_prev_grad != NULL) {
+         cudaFree ( dev->h_prev_grad ) ;
+         dev->h_prev_grad = NULL ;
+         }
+      if (dev->h_err_vec != NULL) {
+         cudaFree ( dev->h_err_vec ) ;
+         dev->h_err_vec = NULL ;
+         }
+      if (dev->h_len_out != NULL) {
+         cudaFree ( dev->h_len_out ) ;
+         dev->h_len_out = NULL ;
+         }
+      if (dev->h_dot_out != NULL) {
+         cudaFree ( dev->h_dot_out ) ;
+         dev->h_dot_out = NULL ;
+         }
+      if (dev->h_batch_sums != NULL) {
+         cudaFree ( dev->h_batch_sums ) ;
+         dev->h_batch_sums = NULL ;
+         }
+
+      if (dev->batch_exec != NULL) {
+         cudaGraphExecDestroy ( dev->batch_exec ) ;
+         dev->batch_exec = NULL ;
+         }
+   #if RBM_CUBLAS
+      if (dev->cublas_handle != NULL) {
+         cublasDestroy ( dev->cublas_handle ) ;
+         dev->cublas_handle = NULL ;
+         }
+      if (dev->cublas_work != NULL) {
+         cudaFree ( dev->cublas_work ) ;
+         dev->cublas_work = NULL ;
+         }
+   #endif
+      if (dev->batch_out != NULL) {
+         cudaFreeHost ( dev->batch_out ) ;
+         dev->batch_out = NULL ;
+         }
+      if (dev->shuffle_pinned != NULL) {
+         cudaFreeHost ( dev->shuffle_pinned ) ;
+         dev->shuffle_pinned = NULL ;
+         }
+      if (dev->snap_out != NULL) {
+         cudaFreeHost ( dev->snap_out ) ;
+         dev->snap_out = NULL ;
+         }
+      if (dev->snap_event != NULL) {
+         cudaEventDestroy ( dev->snap_event ) ;
+         dev->snap_event = NULL ;
+         }
+      if (dev->state_pinned != NULL) {
+         cudaFreeHost ( dev->state_pinned ) ;
+         dev->state_pinned = NULL ;
+         }
+      if (dev->state_event != NULL) {
+         cudaEventDestroy ( dev->state_event ) ;
+         dev->state_event = NULL ;
+         }
+      if (dev->rbm_stream != NULL) {
+         cudaStreamDestroy ( dev->rbm_stream ) ;
+         dev->rbm_stream = NULL ;
+         }
+      if (dev->h_sums != NULL) {
+         cudaFree ( dev->h_sums ) ;
+         dev->h_sums = NULL ;
+         }
+      if (dev->h_peer != NULL) {
+         cudaFree ( dev->h_peer ) ;
+         dev->h_peer = NULL ;
+         }
+      if (dev->sum_event != NULL) {
+         cudaEventDestroy ( dev->sum_event ) ;
+         dev->sum_event = NULL ;
+         }
+      cudaDeviceReset () ;
       }
 
+   n_devices = 0 ;
+   dev = devices ;
+   stream_data = NULL ;
+   stream_next_start = -1 ;
+
    if (reduc_fdata != NULL) {
       FREE ( reduc_fdata ) ;
       reduc_fdata = NULL ;
@@ -1969,6 +3709,4 @@ void rbm_cuda_cleanup ()
       FREE ( fdata ) ;
       fdata = NULL ;
       }
-
-   cudaDeviceReset () ;
 }